@@ -0,0 +1,1354 @@
+/*
+    mpg321 - a fully free clone of mpg123.
+    input.c: Copyright (C) 2001, 2002 Joe Drew
+
+    Originally based heavily upon:
+    plaympeg - Sample MPEG player using the SMPEG library
+    Copyright (C) 1999 Loki Entertainment Software
+
+    Also uses some code from
+    mad - MPEG audio decoder
+    Copyright (C) 2000-2001 Robert Leslie
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#define _LARGEFILE_SOURCE 1
+
+#include "mpg321.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#ifdef __linux__
+#include <sys/vfs.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define USE_IO_URING 1
+#endif
+#endif
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Windowed input. Local files are normally mmap()ed whole, which fails for
+   multi-GB files on 32-bit machines, and on sshfs and friends a page fault
+   can stall the decoder in the middle of a frame for a network round trip.
+   For those files a reader thread pread()s WINDOW_BATCH sized batches ahead
+   of the decoder into WINDOW_BATCHES buffers, and libmad is handed one
+   batch at a time.
+
+   Network streams and stdin are read ahead into a ring buffer, so the
+   decoder never sits in read() waiting for the network. The ring is mapped
+   twice, back to back, so whatever libmad still needs is contiguous even
+   where it wraps, and nothing ever has to be copied. Where the kernel has
+   io_uring, reads are queued with it and reaped by the decoder without a
+   thread; otherwise a reader thread poll()s and read()s. */
+
+/* Files at least this big are read through a window. On 32-bit machines
+   there often isn't the address space for a bigger mapping. */
+#define WINDOW_MIN_SIZE ((off_t)(sizeof(void *) < 8 ? 256 : 4096) * 1024 * 1024)
+
+/* Room in front of each batch to copy the incomplete frame libmad hands
+   back to us; a frame is never more than about 3K */
+#define WINDOW_SLACK 8192
+
+/* Smallest ring we'll use for a stream, whatever --buffer says */
+#define RING_MIN_SIZE 65536
+
+enum
+{
+    BATCH_EMPTY,
+    BATCH_READING,
+    BATCH_FULL
+};
+
+struct batch
+{
+    unsigned char *data; /* WINDOW_SLACK bytes into the batch's memory */
+    off_t pos;           /* file offset of data[0] */
+    ssize_t len;         /* bytes read into data */
+    int state;
+};
+
+#ifdef USE_IO_URING
+struct uring
+{
+    int fd;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_entries, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+
+    /* requests queued but not yet submitted, and reads not yet reaped */
+    unsigned queued;
+    int inflight;
+};
+
+/* user_data of our requests */
+enum
+{
+    URING_READ,
+    URING_CANCEL
+};
+#endif
+
+struct window
+{
+    int fd;
+
+    /* fd is a network stream or stdin, read into ring */
+    int stream;
+
+    /* end of the audio data in the file */
+    off_t end;
+
+    /* next offset for the reader to fetch, and for the decoder to use */
+    off_t next;
+    off_t want;
+
+    /* bumped on every seek, so the reader can drop reads that were in
+       flight at the time */
+    int generation;
+    int quit;
+
+    unsigned char *mem;
+    struct batch batches[WINDOW_BATCHES];
+
+    /* the batch libmad is decoding from */
+    struct batch *current;
+
+    /* streams: the ring, mapped twice over */
+    unsigned char *ring;
+    size_t ring_size;
+
+    /* streams: bytes read so far, bytes libmad is done with, and bytes
+       libmad has been given. ring holds tail..head. */
+    off_t head, tail, given;
+
+    /* streams: where fd was when we started, if it can seek (a file on
+       stdin), or -1 */
+    off_t start;
+
+    /* streams: the far end closed, or there was an error */
+    int eof;
+
+    /* streams: what libmad has is from before window_reposition(), and
+       is no use now */
+    int fresh;
+
+    /* streams: the HTTP connection fd belongs to, for http_want() to
+       strip its framing, or NULL */
+    struct http *http;
+
+    /* streams: the FTP transfer fd is the data connection of, to carry
+       on with if it drops, or NULL */
+    struct ftp *ftp;
+
+    /* streams: the raw:// stream fd is the socket of, which is read
+       through its jitter buffer, or NULL */
+    struct rtp *rtp;
+
+    /* streams: the HTTP or FTP connection dropped part way, and is to be
+       carried on with over another one, till that's been done */
+    int resume;
+
+    /* HTTP and FTP streams: whether the server will send from anywhere
+       in the file, as it said on opening; the http or ftp struct itself
+       is rewritten by window_resume() with the lock let go */
+    int seekable;
+
+    int threaded;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    /* written to to get a stream reader out of poll() */
+    int wake[2];
+
+#ifdef USE_IO_URING
+    struct uring *uring;
+    struct iovec iov;
+
+    /* the thread resuming a dropped stream, there being no reader thread
+       to, till ring_submit() or window_stop_reader() has joined it */
+    int resuming;
+    pthread_t resumer;
+#endif
+};
+
+int use_window_input(int fd, off_t size)
+{
+#ifdef __linux__
+    /* Network and FUSE filesystems */
+    static unsigned long const slow_filesystems[] =
+    {
+        0x65735546, /* FUSE: sshfs, ... */
+        0x6969,     /* NFS */
+        0x517b,     /* SMB */
+        0xff534d42, /* CIFS */
+        0xfe534d42, /* SMB2 */
+        0x01021997, /* 9P */
+        0x73757245, /* Coda */
+        0x5346414f, /* AFS */
+        0
+    };
+    struct statfs fs;
+    int i;
+#endif
+
+    if (size >= WINDOW_MIN_SIZE)
+        return 1;
+
+#ifdef __linux__
+    if (fstatfs(fd, &fs) == 0)
+    {
+        for (i = 0; slow_filesystems[i]; i++)
+        {
+            if (((unsigned long)fs.f_type & 0xffffffffUL) == slow_filesystems[i])
+                return 1;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+/* pread() that doesn't give up on short reads, which FUSE filesystems do */
+static
+ssize_t pread_all(int fd, unsigned char *buf, size_t len, off_t pos)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len)
+    {
+        n = pread(fd, buf + done, len - done, pos + done);
+
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return done ? done : n;
+
+        done += n;
+    }
+
+    return done;
+}
+
+/* read() whatever a stream has for us, unless window_stop_reader() wants
+   the reader thread back first. Returns -errno on errors. raw:// streams
+   are read a batch of datagrams at a time, and passed on in order, as
+   soon as they're in it or have been waited on long enough. */
+static
+ssize_t stream_read(struct window *w, unsigned char *buf, size_t len)
+{
+    struct pollfd fds[2];
+    ssize_t n;
+
+    fds[0].fd = w->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = w->wake[0];
+    fds[1].events = POLLIN;
+
+    while (1)
+    {
+        if (w->rtp && (n = rtp_take(w->rtp, buf, len)) > 0)
+            return n;
+
+        if (poll(fds, 2, w->rtp ? rtp_wait(w->rtp) : -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            return -errno;
+        }
+
+        if (fds[1].revents)
+            return -EINTR;
+
+        if (w->rtp)
+        {
+            if (fds[0].revents && rtp_recv(w->rtp) < 0)
+                return -errno;
+
+            continue;
+        }
+
+        if ((n = read(w->fd, buf, len)) < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+
+            return -errno;
+        }
+
+        return n;
+    }
+}
+
+/* Map size bytes of memory twice over, back to back. size must be a
+   multiple of the page size. */
+static
+unsigned char * ring_map(size_t size)
+{
+    unsigned char *mem;
+    char name[] = "/tmp/mpg321-XXXXXX";
+    int fd = -1;
+
+#ifdef __NR_memfd_create
+    fd = syscall(__NR_memfd_create, "mpg321", 0);
+#endif
+
+    if (fd == -1)
+    {
+        if ((fd = mkstemp(name)) == -1)
+            return NULL;
+
+        unlink(name);
+    }
+
+    if (ftruncate(fd, size) == -1)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    /* reserve room for both copies, then put the memory in each half */
+    mem = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (mem == MAP_FAILED)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    if (mmap(mem, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(mem + size, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(mem, 2 * size);
+        close(fd);
+        return NULL;
+    }
+
+    /* the mappings keep the memory */
+    close(fd);
+
+    return mem;
+}
+
+/* Room in the ring after head. Lock must be held. */
+static
+size_t ring_room(struct window *w)
+{
+    return w->ring_size - (w->head - w->tail);
+}
+
+/* Where the next read on a stream should go: the free part of the ring,
+   or wherever http_want() says. Returns 0 if there's nothing to read now.
+   Lock must be held. */
+static
+int ring_want(struct window *w, struct iovec *iov)
+{
+    size_t room = ring_room(w);
+    unsigned char *dst = w->ring + w->head % w->ring_size;
+
+    if (w->eof || w->resume || !room)
+        return 0;
+
+    if (w->http)
+    {
+        if (!http_want(w->http, dst, room, iov))
+        {
+            w->eof = 1;
+            return 0;
+        }
+
+        return 1;
+    }
+
+    iov->iov_base = dst;
+    iov->iov_len = room;
+
+    return 1;
+}
+
+/* The read ring_want() asked for came back with got, or -errno. Lock must
+   be held. */
+static
+void ring_filled(struct window *w, ssize_t got)
+{
+    if (w->http)
+    {
+        /* counts only what's audio, and -1 at the end of the body */
+        if ((got = http_got(w->http, got)) >= 0)
+            w->head += got;
+
+        /* the connection dropped part way: carry on from there over
+           another one, with window_resume() */
+        else if (w->http->truncated)
+            w->resume = 1;
+
+        else
+            w->eof = 1;
+    }
+
+    else if (got > 0)
+    {
+        w->head += got;
+
+        if (w->ftp)
+        {
+            w->ftp->offset += got;
+            w->ftp->retries = 0;
+        }
+    }
+
+    /* an FTP data connection closing short of the size of the file has
+       dropped: carry on from there over another one */
+    else if (w->ftp && got != -EINTR && got != -EAGAIN)
+        w->resume = 1;
+
+    else if (got != -EINTR && got != -EAGAIN)
+        w->eof = 1;
+
+    pthread_cond_broadcast(&w->cond);
+}
+
+/* Carries on with a dropped HTTP or FTP stream over another connection.
+   That can take up to --connect-timeout, so the lock, which must be held,
+   is let go of meanwhile, and the decoder plays out what's in the ring. */
+static
+void window_resume(struct window *w)
+{
+    int ret;
+
+    pthread_mutex_unlock(&w->lock);
+    ret = w->http ? http_resume(w->http) : ftp_resume(w->ftp);
+    pthread_mutex_lock(&w->lock);
+
+    if (ret == 0)
+        w->fd = w->http ? w->http->fd : w->ftp->data;
+    else
+        w->eof = 1;
+
+    w->resume = 0;
+    pthread_cond_broadcast(&w->cond);
+}
+
+static
+void * window_reader(void *arg)
+{
+    struct window *w = arg;
+    struct batch *b;
+    struct iovec iov;
+    ssize_t len, got;
+    int generation, i;
+
+    pthread_mutex_lock(&w->lock);
+
+    while (!w->quit)
+    {
+        if (w->stream)
+        {
+            if (w->resume)
+            {
+                window_resume(w);
+                continue;
+            }
+
+            if (!ring_want(w, &iov))
+            {
+                pthread_cond_wait(&w->cond, &w->lock);
+                continue;
+            }
+
+            /* libmad never looks past head, so it can carry on decoding
+               while we read in after it */
+            pthread_mutex_unlock(&w->lock);
+            got = iov.iov_len ? stream_read(w, iov.iov_base, iov.iov_len) : 0;
+            pthread_mutex_lock(&w->lock);
+
+            ring_filled(w, got);
+            continue;
+        }
+
+        b = NULL;
+
+        if (w->next < w->end)
+        {
+            for (i = 0; i < WINDOW_BATCHES; i++)
+            {
+                if (w->batches[i].state == BATCH_EMPTY)
+                {
+                    b = &w->batches[i];
+                    break;
+                }
+            }
+        }
+
+        if (!b)
+        {
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+
+        len = (w->end - w->next < WINDOW_BATCH) ? w->end - w->next : WINDOW_BATCH;
+
+        b->state = BATCH_READING;
+        b->pos = w->next;
+        w->next += len;
+        generation = w->generation;
+
+        pthread_mutex_unlock(&w->lock);
+        got = pread_all(w->fd, b->data, len, b->pos);
+        pthread_mutex_lock(&w->lock);
+
+        /* we were seeked away from while reading */
+        if (generation != w->generation)
+        {
+            b->state = BATCH_EMPTY;
+            continue;
+        }
+
+        /* the file got shorter, or there was an error: stop where it ends */
+        if (got < len)
+        {
+            if (got < 0)
+                got = 0;
+
+            w->end = w->next = b->pos + got;
+        }
+
+        b->len = got;
+        b->state = BATCH_FULL;
+        pthread_cond_broadcast(&w->cond);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+#ifdef USE_IO_URING
+#define uring_load(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define uring_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+static
+void uring_close(struct uring *r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_size);
+    if (r->cq_map && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map)
+        munmap(r->sq_map, r->sq_map_size);
+
+    close(r->fd);
+    free(r);
+}
+
+/* NULL if the kernel doesn't do io_uring, or won't let us */
+static
+struct uring * uring_open(unsigned entries)
+{
+    struct io_uring_params p;
+    struct uring *r;
+    void *map;
+
+    if (!(r = calloc(1, sizeof(struct uring))))
+        return NULL;
+
+    memset(&p, 0, sizeof(p));
+
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+    {
+        free(r);
+        return NULL;
+    }
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_map_size > r->sq_map_size)
+            r->sq_map_size = r->cq_map_size;
+        r->cq_map_size = r->sq_map_size;
+    }
+
+    map = mmap(0, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        r->fd, IORING_OFF_SQ_RING);
+    if (map == MAP_FAILED)
+        goto fail;
+    r->sq_map = map;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_map = r->sq_map;
+    else
+    {
+        map = mmap(0, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            r->fd, IORING_OFF_CQ_RING);
+        if (map == MAP_FAILED)
+            goto fail;
+        r->cq_map = map;
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    map = mmap(0, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        r->fd, IORING_OFF_SQES);
+    if (map == MAP_FAILED)
+        goto fail;
+    r->sqes = map;
+
+    r->sq_head = (unsigned *)((char *)r->sq_map + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_map + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_map + p.sq_off.ring_mask);
+    r->sq_entries = (unsigned *)((char *)r->sq_map + p.sq_off.ring_entries);
+    r->sq_array = (unsigned *)((char *)r->sq_map + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_map + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_map + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_map + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_map + p.cq_off.cqes);
+
+    return r;
+
+fail:
+    uring_close(r);
+    return NULL;
+}
+
+/* An entry for a request; it goes to the kernel after uring_queue() and
+   the next uring_enter() */
+static
+struct io_uring_sqe * uring_sqe(struct uring *r, unsigned char opcode, unsigned long long user_data)
+{
+    struct io_uring_sqe *sqe;
+    unsigned tail = *r->sq_tail;
+    unsigned idx;
+
+    if (tail - uring_load(r->sq_head) >= *r->sq_entries)
+        return NULL;
+
+    idx = tail & *r->sq_mask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    r->sq_array[idx] = idx;
+
+    return sqe;
+}
+
+static
+void uring_queue(struct uring *r)
+{
+    uring_store(r->sq_tail, *r->sq_tail + 1);
+    r->queued++;
+}
+
+static
+int uring_enter(struct uring *r, unsigned wait)
+{
+    int n = syscall(__NR_io_uring_enter, r->fd, r->queued, wait,
+        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if (n > 0)
+        r->queued -= ((unsigned)n > r->queued) ? r->queued : (unsigned)n;
+
+    return n;
+}
+
+/* Take in what's come back from the kernel. Lock must be held. */
+static
+void ring_reap(struct window *w)
+{
+    struct uring *r = w->uring;
+    struct io_uring_cqe *cqe;
+    unsigned head = *r->cq_head;
+    unsigned tail = uring_load(r->cq_tail);
+
+    for (; head != tail; head++)
+    {
+        cqe = &r->cqes[head & *r->cq_mask];
+
+        /* a read ring_cancel() called back is no more wrong with the
+           stream than one a signal cut short */
+        if (cqe->user_data == URING_READ)
+        {
+            r->inflight--;
+            ring_filled(w, cqe->res == -ECANCELED ? -EINTR : cqe->res);
+        }
+    }
+
+    uring_store(r->cq_head, head);
+}
+
+/* io_uring streams: window_resume() off the decoder's thread */
+static
+void * window_resumer(void *arg)
+{
+    struct window *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    window_resume(w);
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+/* Queue a read into the free part of the ring, if there isn't one already,
+   and hand it to the kernel; if wait, block until it comes back. Only one
+   read is ever in flight: two on the same stream could complete out of
+   order. A dropped stream is resumed on a thread of its own, and nothing
+   is read meanwhile. Lock must be held. */
+static
+void ring_submit(struct window *w, int wait)
+{
+    struct uring *r = w->uring;
+    struct io_uring_sqe *sqe;
+    off_t head = w->head;
+    sigset_t all, old;
+    int e;
+
+    /* the last resume is over */
+    if (w->resuming && !w->resume)
+    {
+        pthread_join(w->resumer, NULL);
+        w->resuming = 0;
+    }
+
+    if (w->resume && !w->resuming)
+    {
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, &old);
+        e = pthread_create(&w->resumer, NULL, window_resumer, w);
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+        /* no thread: it'll have to be done here */
+        if (e != 0)
+            window_resume(w);
+        else
+            w->resuming = 1;
+    }
+
+    while (r->inflight == 0 && ring_want(w, &w->iov))
+    {
+        /* HTTP has something buffered to pass on first */
+        if (w->iov.iov_len == 0)
+        {
+            ring_filled(w, 0);
+            continue;
+        }
+
+        if (!(sqe = uring_sqe(r, IORING_OP_READV, URING_READ)))
+            break;
+
+        sqe->fd = w->fd;
+        sqe->addr = (unsigned long)&w->iov;
+        sqe->len = 1;
+        sqe->off = (w->start == -1) ? 0 : w->start + w->head;
+        uring_queue(r);
+
+        r->inflight++;
+    }
+
+    /* something's come already */
+    if (w->head != head)
+        wait = 0;
+
+    /* nothing's coming, so don't wait for it; unless the stream's being
+       resumed, which the caller waits on the cond for instead */
+    if (wait && r->inflight == 0)
+    {
+        if (!w->resume)
+            w->eof = 1;
+        wait = 0;
+    }
+
+    if (r->queued || wait)
+    {
+        if (uring_enter(r, wait ? 1 : 0) < 0 && errno != EINTR && errno != EBUSY)
+            w->eof = 1;
+    }
+}
+
+/* Call back the read in flight, so the kernel is done with the ring before
+   it goes. Lock must be held. */
+static
+void ring_cancel(struct window *w)
+{
+    struct uring *r = w->uring;
+    struct io_uring_sqe *sqe;
+
+    if (r->inflight && (sqe = uring_sqe(r, IORING_OP_ASYNC_CANCEL, URING_CANCEL)))
+    {
+        sqe->addr = URING_READ;
+        uring_queue(r);
+    }
+
+    while (r->inflight > 0)
+    {
+        if (uring_enter(r, 1) < 0 && errno != EINTR)
+            break;
+
+        ring_reap(w);
+    }
+}
+#endif /* USE_IO_URING */
+
+static
+struct window * window_new(int fd)
+{
+    struct window *w;
+
+    if (!(w = calloc(1, sizeof(struct window))))
+        return NULL;
+
+    w->fd = fd;
+    w->wake[0] = w->wake[1] = -1;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+
+    return w;
+}
+
+static
+void window_free(struct window *w)
+{
+    if (w->wake[0] != -1)
+    {
+        close(w->wake[0]);
+        close(w->wake[1]);
+    }
+
+    if (w->ring)
+        munmap(w->ring, 2 * w->ring_size);
+
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    free(w->mem);
+    free(w);
+}
+
+static
+int window_start_reader(struct window *w)
+{
+    sigset_t all, old;
+    int i;
+
+    if (w->stream && w->wake[0] == -1 && pipe(w->wake) == -1)
+        return -1;
+
+    /* signals are for the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    i = pthread_create(&w->reader, NULL, window_reader, w);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (i != 0)
+    {
+        errno = i;
+        return -1;
+    }
+
+    w->threaded = 1;
+
+    return 0;
+}
+
+struct window * window_open(int fd, off_t start, off_t end)
+{
+    struct window *w;
+    int i;
+
+    if (!(w = window_new(fd)))
+        return NULL;
+
+    if (!(w->mem = malloc(WINDOW_BATCHES * (WINDOW_SLACK + WINDOW_BATCH))))
+    {
+        window_free(w);
+        return NULL;
+    }
+
+    for (i = 0; i < WINDOW_BATCHES; i++)
+    {
+        w->batches[i].data = w->mem + i * (WINDOW_SLACK + WINDOW_BATCH) + WINDOW_SLACK;
+        w->batches[i].state = BATCH_EMPTY;
+    }
+
+    w->end = end;
+    w->next = w->want = start;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd, start, end - start, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    if (window_start_reader(w) == -1)
+    {
+        i = errno;
+        window_free(w);
+        errno = i;
+        return NULL;
+    }
+
+    return w;
+}
+
+/* Network streams and stdin, with a ring of about size bytes. The body of
+   an HTTP response is read through http, if it's not NULL, fd is the data
+   connection of ftp if that isn't, and the socket of rtp if that isn't. */
+struct window * window_open_stream(int fd, size_t size, struct http *http, struct ftp *ftp, struct rtp *rtp)
+{
+    struct window *w;
+    long page = sysconf(_SC_PAGESIZE);
+    int e;
+
+    if (!(w = window_new(fd)))
+        return NULL;
+
+    if (size < RING_MIN_SIZE)
+        size = RING_MIN_SIZE;
+
+    if (page > 0)
+        size = (size + page - 1) / page * page;
+
+    if (!(w->ring = ring_map(size)))
+    {
+        e = errno;
+        window_free(w);
+        errno = e;
+        return NULL;
+    }
+
+    w->stream = 1;
+    w->http = http;
+    w->ftp = ftp;
+    w->rtp = rtp;
+    w->seekable = (http && http->ranges) || (ftp && ftp->size > 0);
+    w->ring_size = size;
+    w->start = (http || ftp || rtp) ? -1 : lseek(fd, 0, SEEK_CUR);
+
+#ifdef USE_IO_URING
+    /* raw:// streams go through the jitter buffer, which the reader
+       thread looks after */
+    if (!rtp && (w->uring = uring_open(4)))
+    {
+        pthread_mutex_lock(&w->lock);
+        ring_submit(w, 0);
+        pthread_mutex_unlock(&w->lock);
+
+        return w;
+    }
+#endif
+
+    if (window_start_reader(w) == -1)
+    {
+        e = errno;
+        window_free(w);
+        errno = e;
+        return NULL;
+    }
+
+    return w;
+}
+
+/* Stop the reader, and wait till it has; the kernel or the thread is done
+   with the ring when this returns */
+static
+void window_stop_reader(struct window *w)
+{
+    char c;
+
+#ifdef USE_IO_URING
+    if (w->uring)
+    {
+        pthread_mutex_lock(&w->lock);
+        ring_cancel(w);
+        pthread_mutex_unlock(&w->lock);
+
+        /* it has to be let finish: it can't be called back */
+        if (w->resuming)
+        {
+            pthread_join(w->resumer, NULL);
+            w->resuming = 0;
+        }
+
+        return;
+    }
+#endif
+
+    if (w->threaded)
+    {
+        pthread_mutex_lock(&w->lock);
+        w->quit = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+
+        if (w->wake[1] != -1)
+            write(w->wake[1], "", 1);
+
+        pthread_join(w->reader, NULL);
+
+        /* the thread may have been out of poll(), and left the byte */
+        if (w->wake[0] != -1)
+        {
+            fcntl(w->wake[0], F_SETFL, O_NONBLOCK);
+            read(w->wake[0], &c, 1);
+        }
+
+        w->threaded = 0;
+        w->quit = 0;
+    }
+}
+
+/* Also closes the file, unless it's a stream */
+void window_close(struct window *w)
+{
+    window_stop_reader(w);
+
+#ifdef USE_IO_URING
+    if (w->uring)
+        uring_close(w->uring);
+#endif
+
+    if (!w->stream)
+        close(w->fd);
+
+    window_free(w);
+}
+
+/* HTTP and FTP streams: drop what's been read, and carry on from byte pos
+   of the file over another request. Returns -1, and carries on as before,
+   if the server won't do that. */
+int window_reposition(struct window *w, off_t pos)
+{
+    int ret;
+
+    if (!w->http && !w->ftp)
+        return -1;
+
+    window_stop_reader(w);
+
+    pthread_mutex_lock(&w->lock);
+
+    if (w->http)
+        ret = http_reopen(w->http, pos);
+    else
+        ret = ftp_reopen(w->ftp, pos);
+
+    /* the old FTP transfer had to be stopped before the new one could
+       be asked for, so there's nothing to carry on with */
+    if (ret == -1 && w->ftp && w->ftp->data == -1)
+        w->eof = 1;
+
+    if (ret == 0)
+    {
+        w->fd = w->http ? w->http->fd : w->ftp->data;
+        w->head = w->tail = w->given = 0;
+        w->eof = 0;
+        w->resume = 0;
+        w->fresh = 1;
+    }
+
+#ifdef USE_IO_URING
+    if (w->uring)
+        ring_submit(w, 0);
+#endif
+
+    pthread_mutex_unlock(&w->lock);
+
+#ifdef USE_IO_URING
+    if (w->uring)
+        return ret;
+#endif
+
+    if (window_start_reader(w) == -1)
+    {
+        pthread_mutex_lock(&w->lock);
+        w->eof = 1;
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return ret;
+}
+
+/* HTTP and FTP streams: whether window_reposition() has a chance. Needs no lock:
+   it's only set on opening. */
+int window_seekable(struct window *w)
+{
+    return w->seekable;
+}
+
+/* HTTP streams: the ICY metadata that's come in since we last looked, if
+   it's changed. Returns 0 if it hasn't. */
+int window_metadata(struct window *w, char *buf, size_t size)
+{
+    int changed = 0;
+
+    pthread_mutex_lock(&w->lock);
+
+    /* not while window_resume() is swapping in the new connection */
+    if (w->http && !w->resume && w->http->icy_changed)
+    {
+        snprintf(buf, size, "%s", w->http->icy);
+        w->http->icy_changed = 0;
+        changed = 1;
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return changed;
+}
+
+/* Throw away what we have and start reading from pos. Lock must be held. */
+static
+void window_seek(struct window *w, off_t pos)
+{
+    int i;
+
+    w->generation++;
+
+    /* batches being read are dropped by the reader when it's done */
+    for (i = 0; i < WINDOW_BATCHES; i++)
+    {
+        if (w->batches[i].state == BATCH_FULL)
+            w->batches[i].state = BATCH_EMPTY;
+    }
+
+    w->current = NULL;
+    w->next = w->want = pos;
+
+    pthread_cond_broadcast(&w->cond);
+}
+
+/* Wait for the batch at w->want; NULL at the end of the file. Lock must be
+   held. */
+static
+struct batch * window_wait(struct window *w)
+{
+    int i;
+
+    while (1)
+    {
+        for (i = 0; i < WINDOW_BATCHES; i++)
+        {
+            if (w->batches[i].state == BATCH_FULL && w->batches[i].pos == w->want)
+                return &w->batches[i];
+        }
+
+        if (w->want >= w->end)
+            return NULL;
+
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+}
+
+/* Streams using io_uring: take in a finished read and queue the next one
+   while the decoder is busy, so there's data waiting when libmad next
+   asks */
+void window_poll(struct window *w)
+{
+#ifdef USE_IO_URING
+    if (w->uring)
+    {
+        pthread_mutex_lock(&w->lock);
+        ring_reap(w);
+        ring_submit(w, 0);
+        pthread_mutex_unlock(&w->lock);
+    }
+#endif
+}
+
+/* Streams: how much has been read that libmad hasn't been given yet, or
+   -1 if there'll be no more */
+ssize_t window_ahead(struct window *w)
+{
+    ssize_t ahead;
+
+    pthread_mutex_lock(&w->lock);
+
+#ifdef USE_IO_URING
+    if (w->uring)
+        ring_reap(w);
+#endif
+
+    ahead = w->eof ? -1 : w->head - w->given;
+
+    pthread_mutex_unlock(&w->lock);
+
+    return ahead;
+}
+
+/* Streams: give libmad everything from the incomplete frame it passed back
+   to us up to what's been read, once that's at least want bytes. Returns
+   the number of new bytes, 0 at the end. */
+ssize_t window_refill(struct window *w, struct mad_stream *stream, size_t want)
+{
+    ssize_t fresh;
+
+    pthread_mutex_lock(&w->lock);
+
+    /* libmad is done with everything before next_frame, and the reader
+       can have that room */
+    w->tail = w->given;
+    if (stream->buffer && !w->fresh)
+        w->tail -= stream->bufend - stream->next_frame;
+
+    w->fresh = 0;
+
+    pthread_cond_broadcast(&w->cond);
+
+    while (1)
+    {
+#ifdef USE_IO_URING
+        if (w->uring)
+            ring_reap(w);
+#endif
+
+        /* a full ring libmad can't make a frame of won't get any better */
+        if ((w->head > w->given && (size_t)(w->head - w->tail) >= want)
+            || w->eof || !ring_room(w))
+            break;
+
+#ifdef USE_IO_URING
+        if (w->uring)
+        {
+            ring_submit(w, 1);
+
+            /* the resumer broadcasts when it's done */
+            if (!w->resume)
+                continue;
+        }
+#endif
+
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+
+    fresh = w->head - w->given;
+    w->given = w->head;
+
+#ifdef USE_IO_URING
+    if (w->uring)
+        ring_submit(w, 0);
+#endif
+
+    pthread_mutex_unlock(&w->lock);
+
+    mad_stream_buffer(stream, w->ring + w->tail % w->ring_size, w->given - w->tail);
+
+    return fresh;
+}
+
+enum mad_flow read_from_window(void *data, struct mad_stream *stream)
+{
+    buffer *playbuf = data;
+    struct window *w = playbuf->window;
+    struct batch *b;
+    unsigned char const *keep = NULL;
+    size_t keeplen = 0;
+
+    /* libmad asks us for more data when it runs out. We don't have any more,
+       so we want to quit here. */
+    if (status != MPG321_REWINDING && playbuf->done)
+    {
+        status = MPG321_STOPPED;
+        if (options.opt & MPG321_REMOTE_PLAY) remote_state(0);
+        return MAD_FLOW_STOP;
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    if (status == MPG321_REWINDING)
+    {
+        window_seek(w, playbuf->frames[current_frame]);
+        options.seek = 0;
+        status = MPG321_PLAYING;
+        playbuf->done = 0;
+    }
+
+    /* need to carry over the bytes which comprise an incomplete frame,
+       that mad has passed back to us */
+    else if (stream->buffer && w->current)
+    {
+        keep = stream->next_frame;
+        keeplen = stream->bufend - stream->next_frame;
+
+        if (keeplen > WINDOW_SLACK)
+        {
+            keep += keeplen - WINDOW_SLACK;
+            keeplen = WINDOW_SLACK;
+        }
+    }
+
+    if (status != MPG321_SEEKING) /* seeking goes to playing during the decoding process */
+        status = MPG321_PLAYING;
+
+    if (!(b = window_wait(w)))
+    {
+        /* end of the file: all that's left is what libmad already has */
+        playbuf->done = 1;
+        pthread_mutex_unlock(&w->lock);
+
+        mad_stream_buffer(stream, keep, keeplen);
+
+        return MAD_FLOW_CONTINUE;
+    }
+
+    if (keeplen)
+        memcpy(b->data - keeplen, keep, keeplen);
+
+    /* the reader can have the old batch back now */
+    if (w->current)
+    {
+        w->current->state = BATCH_EMPTY;
+        pthread_cond_broadcast(&w->cond);
+    }
+
+    w->current = b;
+    w->want = b->pos + b->len;
+
+    if (w->want >= w->end)
+        playbuf->done = 1;
+
+    pthread_mutex_unlock(&w->lock);
+
+    mad_stream_buffer(stream, b->data - keeplen, b->len + keeplen);
+
+    return MAD_FLOW_CONTINUE;
+}
@@ -40,20 +40,87 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdlib.h>
 
 unsigned long current_frame=0;
 
+/* Paging advice for mmap()ed input. The file is handed to libmad a window
+   at a time; at each step the kernel is asked to read ahead the next few
+   windows and may drop the pages we've already played. This keeps huge
+   files from staying resident, and keeps page faults out of the decoder. */
+static
+void mmap_advise(buffer *playbuf, void *pos)
+{
+#ifdef MADV_WILLNEED
+    long pagesize = sysconf(_SC_PAGESIZE);
+    ssize_t at = ((pos - playbuf->buf) / pagesize) * pagesize;
+    ssize_t ahead = MMAP_WINDOW * MMAP_AHEAD;
+    ssize_t behind = at - MMAP_WINDOW; /* leave a little for short rewinds */
+
+    if (at + ahead > playbuf->length)
+        ahead = playbuf->length - at;
+
+    if (ahead > 0)
+        madvise(playbuf->buf + at, ahead, MADV_WILLNEED);
+
+    if (behind > playbuf->released)
+    {
+        madvise(playbuf->buf + playbuf->released, behind - playbuf->released, MADV_DONTNEED);
+        playbuf->released = behind;
+    }
+
+    /* after a rewind, we may have to drop the same pages again */
+    else if (at < playbuf->released)
+    {
+        playbuf->released = (behind > 0) ? behind : 0;
+    }
+#endif
+}
+
+/* Ask for the pages around where a seek to frame will land. Frames are
+   skipped by decoding their headers, so the pages in between are read
+   anyway, but this gets the I/O for the far end started straight away. */
+static
+void mmap_advise_seek(buffer *playbuf, unsigned long frame)
+{
+#ifdef MADV_WILLNEED
+    long pagesize = sysconf(_SC_PAGESIZE);
+    ssize_t at, len = MMAP_WINDOW * (MMAP_AHEAD + 1);
+
+    if (!playbuf->num_frames)
+        return;
+
+    if (frame > playbuf->num_frames)
+        frame = playbuf->num_frames;
+
+    at = playbuf->offset + (double)(playbuf->length - playbuf->offset)
+            * frame / playbuf->num_frames - MMAP_WINDOW;
+
+    if (at < 0)
+        at = 0;
+
+    at = (at / pagesize) * pagesize;
+
+    if (at + len > playbuf->length)
+        len = playbuf->length - at;
+
+    if (len > 0)
+        madvise(playbuf->buf + at, len, MADV_WILLNEED);
+#endif
+}
+
 enum mad_flow read_from_mmap(void *data, struct mad_stream *stream)
 {
     buffer *playbuf = (buffer *)data;
     void *mpegdata = NULL;
+    ssize_t len;
     
     /* libmad asks us for more data when it runs out. We don't have any more,
        so we want to quit here. */
     if (status != MPG321_REWINDING && playbuf->done)
     {
         status = MPG321_STOPPED;
-        if (options.opt & MPG321_REMOTE_PLAY) printf("@P 0\n");
+        if (options.opt & MPG321_REMOTE_PLAY) remote_state(0);
         return MAD_FLOW_STOP;
     }
 
@@ -63,57 +130,264 @@ enum mad_flow read_from_mmap(void *data, struct mad_stream *stream)
         exit(1);
     }
     
-    mpegdata = playbuf->buf;
+    /* carry on from the incomplete frame libmad has passed back to us */
+    if (stream->buffer)
+    {
+        mpegdata = (void *)stream->next_frame;
+    }
+
+    else
+    {
+        mpegdata = playbuf->buf + playbuf->offset;
+
+#ifdef MADV_SEQUENTIAL
+        madvise(playbuf->buf, playbuf->length, MADV_SEQUENTIAL);
+#endif
+
+        /* -k, unpausing and absolute jumps all start the file over and
+           skip frames from the beginning */
+        if (status == MPG321_SEEKING && options.seek)
+            mmap_advise_seek(playbuf, options.seek);
+    }
 
     if(status == MPG321_REWINDING)
     {
-        mpegdata = playbuf->frames[current_frame];
+        mpegdata = playbuf->buf + playbuf->frames[current_frame];
         options.seek = 0;
         status = MPG321_PLAYING;
+        playbuf->done = 0;
     }
 
     if (status != MPG321_SEEKING) /* seeking goes to playing during the decoding process */
         status = MPG321_PLAYING;
 
-    playbuf->done = 1;
+    len = playbuf->length - (mpegdata - playbuf->buf);
+
+    if (len > MMAP_WINDOW)
+        len = MMAP_WINDOW;
+    else
+        playbuf->done = 1;
+
+    mmap_advise(playbuf, mpegdata);
 
-    mad_stream_buffer(stream, mpegdata, playbuf->length - (mpegdata - playbuf->buf));
+    mad_stream_buffer(stream, mpegdata, len);
     
     return MAD_FLOW_CONTINUE;
 }
 
-/* assumes that playbuf->buf has been preallocated to BUF_SIZE */
-enum mad_flow read_from_fd(void *data, struct mad_stream *stream)
+/* w in bytes, at bitrate bits per second */
+static
+size_t watermark_bytes(watermark const *w, unsigned long bitrate)
 {
-    buffer *playbuf = data;
-    int bytes_to_preserve = stream->bufend - stream->next_frame;
-    
-    if(playbuf->done)
+    if (w->ms)
+        return (size_t)((double)w->amount * bitrate / 8000);
+
+    return w->amount;
+}
+
+/* The bitrate of the first frame in len bytes at p, or 0 if there isn't
+   one there */
+static
+unsigned long first_bitrate(unsigned char const *p, size_t len)
+{
+    struct mad_stream stream;
+    struct mad_header header;
+    unsigned long bitrate = 0;
+
+    mad_stream_init(&stream);
+    mad_header_init(&header);
+    mad_stream_buffer(&stream, p, len);
+
+    while (1)
     {
-        status = MPG321_STOPPED;
-        return MAD_FLOW_STOP;
+        if (mad_header_decode(&header, &stream) == 0)
+        {
+            bitrate = header.bitrate;
+            break;
+        }
+
+        if (!MAD_RECOVERABLE(stream.error))
+            break;
+    }
+
+    mad_header_finish(&header);
+    mad_stream_finish(&stream);
+
+    return bitrate;
+}
+
+/* HTTP and FTP streams: estimate where frame starts, from the Xing TOC if there
+   is one, or else taking every frame to be the same size */
+static
+off_t frame_offset(buffer *playbuf, unsigned long frame)
+{
+    off_t audio = playbuf->length - playbuf->offset;
+    double percent = 100.0 * frame / playbuf->num_frames;
+    double a, b;
+    int i;
+
+    if (percent > 99.9)
+        percent = 99.9;
+
+    if (playbuf->has_toc)
+    {
+        i = (int)percent;
+        a = playbuf->toc[i];
+        b = (i < 99) ? playbuf->toc[i + 1] : 256;
+
+        return playbuf->offset + (off_t)((a + (b - a) * (percent - i)) / 256 * audio);
     }
 
+    return playbuf->offset + (off_t)(percent / 100 * audio);
+}
+
+/* Network streams the server will send from anywhere in, of known
+   length */
+static
+int can_jump(buffer *playbuf)
+{
+    return (playbuf->http || playbuf->ftp) && window_seekable(playbuf->window)
+        && playbuf->num_frames > 0 && playbuf->length > playbuf->offset;
+}
+
+/* HTTP and FTP streams: carry on from frame, asking the server for the
+   file from about where it starts. Returns -1 if it can't be done. */
+static
+int stream_jump(buffer *playbuf, unsigned long frame)
+{
+    double ms;
+
+    if (!can_jump(playbuf))
+        return -1;
+
+    if (frame > playbuf->num_frames)
+        frame = playbuf->num_frames;
+
+    if (window_reposition(playbuf->window, frame_offset(playbuf, frame)) == -1)
+        return -1;
+
+    current_frame = frame;
+
+    ms = (double)mad_timer_count(playbuf->duration, MAD_UNITS_MILLISECONDS)
+        * frame / playbuf->num_frames;
+    mad_timer_set(&current_time, (long)(ms / 1000), (long)ms % 1000, 1000);
+
+    playbuf->done = 0;
+    playbuf->buffering = 1;
+
+    return 0;
+}
+
+/* network streams and stdin, read ahead into playbuf->window; see input.c */
+enum mad_flow read_from_fd(void *data, struct mad_stream *stream)
+{
+    buffer *playbuf = data;
+    ssize_t bytes_read = 0, ahead;
+    size_t len, high;
+    unsigned long skip = 0;
+    char meta[ICY_META_SIZE];
+
+    /* libmad hasn't been given a buffer yet at the start of the stream */
+    int first = (stream->buffer == NULL);
+    
     if(playbuf->fd == -1)
     {
         fprintf(stderr, "read_from_fd called when not expected!\n");
         exit(1);
     }
     
-    if(!playbuf->buf)
+    if(!playbuf->window)
     {
-        fprintf(stderr, "read_from_fd called with null buf!\n");
+        fprintf(stderr, "read_from_fd called with no window!\n");
+        exit(1);
     }
     
-    /* need to preserve the bytes which comprise an incomplete
-       frame, that mad has passed back to us */
-    if (bytes_to_preserve)
-        memmove(playbuf->buf, stream->next_frame, bytes_to_preserve);
+    /* a JUMP on an HTTP or FTP stream; see move(). The decoder has been started
+       again, but this isn't the start of the stream. */
+    if (status == MPG321_REWINDING)
+    {
+        stream_jump(playbuf, current_frame);
+        status = MPG321_PLAYING;
+        first = 0;
+    }
+
+    if(playbuf->done)
+    {
+        status = MPG321_STOPPED;
+        return MAD_FLOW_STOP;
+    }
+
+    /* Network streams: when what's come in since libmad last asked is
+       down to the low watermark, stop and build back up to the high one */
+    if (playbuf->fd != fileno(stdin) && !playbuf->buffering
+        && (ahead = window_ahead(playbuf->window)) >= 0
+        && (size_t)ahead <= watermark_bytes(&options.low_watermark, playbuf->bitrate))
+        playbuf->buffering = 1;
 
-    if( !(read(playbuf->fd, playbuf->buf + bytes_to_preserve, BUF_SIZE - bytes_to_preserve) > 0) )
+    if( !((bytes_read = window_refill(playbuf->window, stream, 0)) > 0) )
         playbuf->done = 1;
 
-    mad_stream_buffer(stream, playbuf->buf, playbuf->length);
+    /* Shoutcast/Icecast stream titles, as they change */
+    if (playbuf->http && window_metadata(playbuf->window, meta, sizeof(meta)))
+    {
+        if (options.opt & MPG321_REMOTE_PLAY)
+            remote_info(REMOTE_INFO_ICY, meta);
+        else if (!(options.opt & MPG321_QUIET_PLAY))
+            fprintf(stderr, "ICY-META: %s\n", meta);
+    }
+
+    /* At the start of the stream, have libmad skip over any ID3v2/APE tag
+       or RIFF header in one step, even if it runs on past this buffer. */
+    if (first && bytes_read > 0)
+    {
+        unsigned long datalen;
+
+        playbuf->offset = skip = leading_tag_size(stream->buffer, bytes_read, &datalen);
+
+        /* Knowing how long the file is, we can tell how long it plays for
+           and where its frames are, and needn't download what -k skips */
+        if ((playbuf->http || playbuf->ftp) && playbuf->length > 0 && playbuf->offset < bytes_read)
+        {
+            scan(stream->buffer + playbuf->offset, bytes_read - playbuf->offset,
+                 playbuf->length - playbuf->offset, playbuf);
+
+            if (status == MPG321_SEEKING && options.seek
+                && stream_jump(playbuf, options.seek) == 0)
+            {
+                options.seek = 0;
+                status = MPG321_PLAYING;
+                skip = 0;
+
+                if( !((bytes_read = window_refill(playbuf->window, stream, 0)) > 0) )
+                    playbuf->done = 1;
+            }
+        }
+    }
+
+    /* Don't start playing until the high watermark is reached */
+    if (playbuf->buffering && bytes_read > 0)
+    {
+        len = stream->bufend - stream->buffer;
+
+        if (!playbuf->bitrate && skip < len)
+            playbuf->bitrate = first_bitrate(stream->buffer + skip, len - skip);
+
+        if ((high = watermark_bytes(&options.high_watermark, playbuf->bitrate)) > len)
+        {
+            if (options.opt & MPG321_REMOTE_PLAY)
+                remote_buffering(1);
+
+            bytes_read += window_refill(playbuf->window, stream, high);
+
+            if (options.opt & MPG321_REMOTE_PLAY)
+                remote_buffering(0);
+        }
+
+        playbuf->buffering = 0;
+    }
+
+    if (skip)
+        mad_stream_skip(stream, skip);
     
     return MAD_FLOW_CONTINUE;
 }    
@@ -167,13 +441,68 @@ char * modestringucase(enum mad_mode mode)
     }
 }
 
-enum mad_flow read_header(void *data, struct mad_header const * header)
+/* Whether it's time for a status line: once options.status_interval ms
+   have gone by since the last, and no more often than every -G frames */
+static
+int status_due(void)
+{
+    static long last;
+    long now;
+
+    if (options.skip_printing_frames && current_frame % options.skip_printing_frames)
+        return 0;
+
+    if (!options.status_interval)
+        return 1;
+
+    /* the clock going back shouldn't stop them */
+    if ((now = now_ms()) - last < options.status_interval && now >= last)
+        return 0;
+
+    last = now;
+    return 1;
+}
+
+/* The Frame# line for -v, or the @F line for -R */
+static
+void show_status(buffer *playbuf)
 {
     char long_currenttime_str[14]; /* this *will* fill if you're using 100000+ minute mp3s */
     char long_remaintime_str[14];
+    mad_timer_t time_remaining;
+
+    if (mad_timer_compare(playbuf->duration, mad_timer_zero) == 0)
+        time_remaining = current_time;
+    else
+        time_remaining = playbuf->duration;
+
+    mad_timer_negate(&current_time);
+
+    mad_timer_add(&time_remaining, current_time);
+    mad_timer_negate(&current_time);
+
+    if (options.opt & MPG321_VERBOSE_PLAY)
+    {
+        mad_timer_string(current_time, long_currenttime_str, "%.2u:%.2u.%.2u", MAD_UNITS_MINUTES,
+                            MAD_UNITS_CENTISECONDS, 0);
+        mad_timer_string(time_remaining, long_remaintime_str, "%.2u:%.2u.%.2u", MAD_UNITS_MINUTES,
+                            MAD_UNITS_CENTISECONDS, 0);
+
+        fprintf(stderr, "Frame# %5lu [%5lu], Time: %s [%s], \r", current_frame, 
+                playbuf->num_frames > 0 ? playbuf->num_frames - current_frame : 0, long_currenttime_str, long_remaintime_str);
+    }
     
+    else
+    {
+        remote_frame(current_frame, playbuf->num_frames - current_frame, current_time, time_remaining);
+
+        remote_flush();
+    }
+}
+
+enum mad_flow read_header(void *data, struct mad_header const * header)
+{
     buffer *playbuf = (buffer *)data;
-    mad_timer_t time_remaining;
     
     if (stop_playing_file)
     {
@@ -181,6 +510,14 @@ enum mad_flow read_header(void *data, struct mad_header const * header)
         return MAD_FLOW_STOP;
     }
     
+    /* keep the reads for a stream going between refills */
+    if (playbuf->fd != -1 && playbuf->window)
+        window_poll(playbuf->window);
+
+    /* entries piped in while this plays */
+    if (playbuf->pl && playbuf->pl->streaming)
+        playlist_poll(playbuf->pl);
+
     if(options.opt & MPG321_REMOTE_PLAY)
     {
         enum mad_flow mf;
@@ -201,27 +538,11 @@ enum mad_flow read_header(void *data, struct mad_header const * header)
 
     mad_timer_add(&current_time, header->duration);
 
-    if(options.opt & (MPG321_VERBOSE_PLAY | MPG321_REMOTE_PLAY))
-    {
-        mad_timer_string(current_time, long_currenttime_str, "%.2u:%.2u.%.2u", MAD_UNITS_MINUTES,
-                            MAD_UNITS_CENTISECONDS, 0);
-
-        if (mad_timer_compare(playbuf->duration, mad_timer_zero) == 0)
-            time_remaining = current_time;
-        else
-            time_remaining = playbuf->duration;
-
-        mad_timer_negate(&current_time);
-
-        mad_timer_add(&time_remaining, current_time);
-        mad_timer_negate(&current_time);
+    /* for the watermarks in milliseconds */
+    playbuf->bitrate = header->bitrate;
 
-        mad_timer_string(time_remaining, long_remaintime_str, "%.2u:%.2u.%.2u", MAD_UNITS_MINUTES,
-                            MAD_UNITS_CENTISECONDS, 0);
-    }
-                        
     /* update cached table of frames & times */
-    if (current_frame <= playbuf->num_frames) /* we only allocate enough for our estimate. */
+    if (playbuf->frames && current_frame <= playbuf->num_frames) /* we only allocate enough for our estimate. */
     {
         playbuf->frames[current_frame] = playbuf->frames[current_frame-1] + (header->bitrate / 8 / 1000)
             * mad_timer_count(header->duration, MAD_UNITS_MILLISECONDS);
@@ -233,12 +554,7 @@ enum mad_flow read_header(void *data, struct mad_header const * header)
         file_change = 0;
         if (options.opt & MPG321_REMOTE_PLAY)
         {
-            printf("@S 1.0 %d %d %s %d %ld %d %d %d %d %ld %d\n", header->layer, header->samplerate,
-                modestringucase(header->mode), header->mode_extension, 
-                (header->bitrate / 8 / 100) * mad_timer_count(header->duration, MAD_UNITS_CENTISECONDS),
-                MAD_NCHANNELS(header), header->flags & MAD_FLAG_COPYRIGHT ? 1 : 0, 
-                header->flags & MAD_FLAG_PROTECTION ? 1 : 0, header->emphasis,
-                header->bitrate/1000, header->mode_extension);
+            remote_stream(header);
         }    
 
         else if (options.opt & MPG321_VERBOSE_PLAY)/*zip it good*/
@@ -274,22 +590,8 @@ enum mad_flow read_header(void *data, struct mad_header const * header)
         status = MPG321_PLAYING;
     }
 
-    if (options.opt & MPG321_VERBOSE_PLAY)
-    {
-        if (!options.skip_printing_frames 
-            || (options.skip_printing_frames && !(current_frame % options.skip_printing_frames)))
-            fprintf(stderr, "Frame# %5lu [%5lu], Time: %s [%s], \r", current_frame, 
-                    playbuf->num_frames > 0 ? playbuf->num_frames - current_frame : 0, long_currenttime_str, long_remaintime_str);
-    }
-    
-    else if (options.opt & MPG321_REMOTE_PLAY)
-    {
-        if (!options.skip_printing_frames 
-            || (options.skip_printing_frames && !(current_frame % options.skip_printing_frames)))
-            printf("@F %ld %ld %.2f %.2f\n", current_frame, playbuf->num_frames - current_frame,
-                ((double)mad_timer_count(current_time, MAD_UNITS_CENTISECONDS)/100.0),
-                ((double)mad_timer_count(time_remaining, MAD_UNITS_CENTISECONDS)/100.0));
-    }
+    if ((options.opt & (MPG321_VERBOSE_PLAY | MPG321_REMOTE_PLAY)) && status_due())
+        show_status(playbuf);
     
     return MAD_FLOW_CONTINUE;
 }        
@@ -366,9 +668,179 @@ int parse_xing(struct xing *xing, struct mad_bitptr ptr, unsigned int bitlen)
 }
 
 
+/* Tags and wrappers around the audio data. Each of these looks at the
+   bytes at p and returns the total size of the tag found there, or 0.
+   Only the size fields are read, so the tag itself doesn't need to be
+   in the buffer; this way a tag with megabytes of cover art costs
+   nothing to step over. */
+
+static
+unsigned long syncsafe(unsigned char const *p)
+{
+    return (p[0] << 21) | (p[1] << 14) | (p[2] << 7) | p[3];
+}
+
+static
+unsigned long le32(unsigned char const *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+/* ID3v2 header, "ID3", with an optional footer after the tag */
+static
+unsigned long id3v2_size(unsigned char const *p, unsigned long avail)
+{
+    if (avail < 10 || memcmp(p, "ID3", 3) != 0)
+        return 0;
+
+    if (p[3] == 0xff || p[4] == 0xff
+        || ((p[6] | p[7] | p[8] | p[9]) & 0x80))
+        return 0;
+
+    return 10 + syncsafe(p + 6) + ((p[5] & 0x10) ? 10 : 0);
+}
+
+/* ID3v2 footer, "3DI", at the end of a tag appended to the file */
+static
+unsigned long id3v2_footer_size(unsigned char const *p, unsigned long avail)
+{
+    if (avail < 10 || memcmp(p, "3DI", 3) != 0)
+        return 0;
+
+    if (p[3] == 0xff || p[4] == 0xff
+        || ((p[6] | p[7] | p[8] | p[9]) & 0x80))
+        return 0;
+
+    return 20 + syncsafe(p + 6);
+}
+
+/* APEv2 header or footer. The size field counts the items and the footer,
+   but not the header; bit 31 of the flags says if there is a header. */
+static
+unsigned long apev2_size(unsigned char const *p, unsigned long avail)
+{
+    if (avail < 32 || memcmp(p, "APETAGEX", 8) != 0)
+        return 0;
+
+    return le32(p + 12) + ((p[23] & 0x80) ? 32 : 0);
+}
+
+/* RIFF/WAVE file containing MPEG audio. Returns the offset of the payload
+   of the "data" chunk, and puts its length in *datalen. */
+static
+unsigned long riff_size(unsigned char const *p, unsigned long avail, unsigned long *datalen)
+{
+    unsigned long pos = 12;
+
+    if (avail < 12 || memcmp(p, "RIFF", 4) != 0 || memcmp(p + 8, "WAVE", 4) != 0)
+        return 0;
+
+    while (pos + 8 <= avail)
+    {
+        unsigned long chunklen = le32(p + pos + 4);
+
+        if (memcmp(p + pos, "data", 4) == 0)
+        {
+            *datalen = chunklen;
+            return pos + 8;
+        }
+
+        if (chunklen > avail)
+            break;
+
+        /* chunks are padded to an even length */
+        pos += 8 + chunklen + (chunklen & 1);
+    }
+
+    /* the data chunk isn't within the buffer; let libmad resync instead */
+    return 0;
+}
+
+/* Size of all the tags and wrappers at the start of p. If there is a RIFF
+   header, *datalen is set to the length of its data chunk, otherwise to 0.
+   Streams can't be searched from the end, so this is all read_from_fd()
+   can use. */
+unsigned long leading_tag_size(unsigned char const *p, unsigned long avail, unsigned long *datalen)
+{
+    unsigned long total = 0, size;
+
+    *datalen = 0;
+
+    while (total < avail)
+    {
+        if ((size = id3v2_size(p + total, avail - total))
+            || (size = apev2_size(p + total, avail - total)))
+        {
+            total += size;
+        }
+
+        /* the audio follows the RIFF header directly */
+        else if ((size = riff_size(p + total, avail - total, datalen)))
+        {
+            total += size;
+            break;
+        }
+
+        else
+            break;
+    }
+
+    return total;
+}
+
+/* Size of all the tags at the end of the len bytes at data, which must end
+   where the file does. Trailing tags can be stacked in any order, i.e.
+   APEv2 then ID3v1. */
+unsigned long trailing_tag_size(unsigned char const *data, unsigned long len)
+{
+    unsigned long total = 0, size, left;
+
+    while ((left = len - total) >= 32)
+    {
+        if (left >= 128 && memcmp(data + left - 128, "TAG", 3) == 0)
+            size = 128;
+        else if (!(size = apev2_size(data + left - 32, 32)))
+            size = id3v2_footer_size(data + left - 10, 10);
+
+        if (!size || size > left)
+            break;
+
+        total += size;
+    }
+
+    return total;
+}
+
+/* Find the MPEG audio data in a whole file: skip ID3v2 and APEv2 tags and
+   RIFF/WAVE wrappers at the start, and ID3v1, APEv2 and appended ID3v2
+   tags at the end. *start and *end are byte offsets into data. */
+void find_audio_data(unsigned char const *data, off_t len, off_t *start, off_t *end)
+{
+    unsigned long datalen;
+
+    *start = leading_tag_size(data, len, &datalen);
+    *end = len;
+
+    /* anything after the data chunk isn't audio */
+    if (datalen && *start + datalen < len)
+        *end = *start + datalen;
+
+    /* a broken size field could have taken us past the end. Don't trust it */
+    if (*start >= *end)
+    {
+        *start = 0;
+        *end = len;
+    }
+
+    *end -= trailing_tag_size(data + *start, *end - *start);
+}
+
 /* Following two functions are adapted from mad_timer, from the 
    libmad distribution */
-void scan(void const *ptr, ssize_t len, buffer *buf)
+
+/* ptr and len are the start of the audio data, total its full length. They
+   differ if we only read the start of a big file; see calc_length(). */
+void scan(void const *ptr, ssize_t len, off_t total, buffer *buf)
 {
     struct mad_stream stream;
     struct mad_header header;
@@ -377,6 +849,7 @@ void scan(void const *ptr, ssize_t len, buffer *buf)
     unsigned long bitrate = 0;
     int has_xing = 0;
     int is_vbr = 0;
+    ssize_t scanned;
 
     mad_stream_init(&stream);
     mad_header_init(&header);
@@ -384,6 +857,7 @@ void scan(void const *ptr, ssize_t len, buffer *buf)
     mad_stream_buffer(&stream, ptr, len);
 
     buf->num_frames = 0;
+    buf->has_toc = 0;
 
     /* There are three ways of calculating the length of an mp3:
       1) Constant bitrate: One frame can provide the information
@@ -413,6 +887,13 @@ void scan(void const *ptr, ssize_t len, buffer *buf)
             if(parse_xing(&xing, stream.anc_ptr, stream.anc_bitlen))
             {
                 is_vbr = 1;
+
+                /* kept for seeking in HTTP and FTP streams */
+                if (xing.flags & XING_TOC)
+                {
+                    memcpy(buf->toc, xing.toc, sizeof(buf->toc));
+                    buf->has_toc = 1;
+                }
                 
                 if (xing.flags & XING_FRAMES)
                 {
@@ -455,13 +936,19 @@ void scan(void const *ptr, ssize_t len, buffer *buf)
             break;
         }
 
+        /* Nor if the playlist has said how long it is */
+        if (buf->listed_length && (buf->num_frames > 20))
+        {
+            break;
+        }
+
         mad_timer_add(&buf->duration, header.duration);
     }
 
     if (!is_vbr)
     {
        if (header.bitrate!=0 && MAD_NSBSAMPLES(&header)!=0) {
-        double time = (len * 8.0) / (header.bitrate); /* time in seconds */
+        double time = (total * 8.0) / (header.bitrate); /* time in seconds */
         double timefrac = (double)time - ((long)(time));
         long nsamples = 32 * MAD_NSBSAMPLES(&header); /* samples per frame */
         
@@ -479,6 +966,27 @@ void scan(void const *ptr, ssize_t len, buffer *buf)
         buf->duration = header.duration;
     }
 
+    else if (buf->listed_length && header.samplerate && MAD_NSBSAMPLES(&header))
+    {
+        /* Take the playlist's word for it, rather than count every frame
+           of a VBR file with no Xing header */
+        buf->num_frames = (double)buf->listed_length * header.samplerate / (32 * MAD_NSBSAMPLES(&header));
+        mad_timer_set(&buf->duration, buf->listed_length, 0, 1);
+    }
+
+    else if ((scanned = stream.next_frame - (unsigned char const *)ptr) > 0
+             && scanned < total)
+    {
+        /* We stopped early, or weren't given the whole file. The durations
+           and frames we've counted give the average frame size; make an
+           estimate for the rest of the file from that. */
+        double scale = (double)total / scanned;
+        double time = mad_timer_count(buf->duration, MAD_UNITS_MILLISECONDS) * scale / 1000;
+
+        buf->num_frames = buf->num_frames * scale;
+        mad_timer_set(&buf->duration, (long)time, (long)((time - (long)time) * 1000), 1000);
+    }
+
     else
     {
         /* the durations have been added up, and the number of frames
@@ -489,6 +997,104 @@ void scan(void const *ptr, ssize_t len, buffer *buf)
     mad_stream_finish(&stream);
 }
 
+/* --send: pass the frames of an mmap()ed file on over the network, each as
+   it would have been played, instead of decoding them. read_header() does
+   the counting, -k, -n and remote control, as it does when decoding. */
+void send_file(buffer *playbuf, struct sender *s)
+{
+    struct mad_stream stream;
+    struct mad_header header;
+    unsigned char const *start = playbuf->buf;
+    unsigned char const *advised = NULL;
+    enum mad_flow flow;
+    off_t from = playbuf->offset;
+    int ended = 0;
+
+#ifdef MADV_SEQUENTIAL
+    madvise(playbuf->buf, playbuf->length, MADV_SEQUENTIAL);
+#endif
+
+    if (status == MPG321_SEEKING && options.seek)
+        mmap_advise_seek(playbuf, options.seek);
+
+    mad_stream_init(&stream);
+    mad_header_init(&header);
+
+    while (1)
+    {
+        mad_stream_buffer(&stream, start + from, playbuf->length - from);
+
+        while (1)
+        {
+            if (mad_header_decode(&header, &stream) == -1)
+            {
+                if (MAD_RECOVERABLE(stream.error))
+                    continue;
+                ended = 1;
+                break;
+            }
+
+            if (!advised || stream.this_frame - advised >= MMAP_WINDOW)
+            {
+                mmap_advise(playbuf, (void *)stream.this_frame);
+                advised = stream.this_frame;
+            }
+
+            if ((flow = read_header(playbuf, &header)) == MAD_FLOW_STOP
+                || flow == MAD_FLOW_BREAK)
+                break;
+
+            /* the table of frames, exact this time */
+            if (playbuf->frames && current_frame <= playbuf->num_frames)
+                playbuf->frames[current_frame] = stream.next_frame - start;
+
+            if (flow == MAD_FLOW_CONTINUE)
+            {
+                sender_frame(s, stream.this_frame, stream.next_frame - stream.this_frame,
+                             header.duration);
+
+                if (server)
+                    serve_frame(server, stream.this_frame, stream.next_frame - stream.this_frame);
+            }
+        }
+
+        if (ended)
+            break;
+
+        /* a JUMP back, to a frame in the table, or to one counted to from
+           the start */
+        if (status == MPG321_REWINDING)
+        {
+            from = playbuf->frames[current_frame];
+            options.seek = 0;
+            status = MPG321_PLAYING;
+        }
+
+        else if (status == MPG321_SEEKING && options.seek)
+        {
+            from = playbuf->offset;
+            current_time = mad_timer_zero;
+        }
+
+        else
+            break;
+
+        advised = NULL;
+    }
+
+    sender_flush(s);
+
+    mad_header_finish(&header);
+    mad_stream_finish(&stream);
+
+    if (status != MPG321_STOPPED)
+    {
+        status = MPG321_STOPPED;
+        if (options.opt & MPG321_REMOTE_PLAY)
+            remote_state(0);
+    }
+}
+
 void pause_play(buffer *buf, playlist *pl)
 {
     static char file[PATH_MAX] = "";
@@ -509,7 +1115,7 @@ void pause_play(buffer *buf, playlist *pl)
         file[PATH_MAX-1]='\0';
         clear_remote_file(pl);
         seek = current_frame;
-        printf("@P 1\n");
+        remote_state(1);
     }
     
     /* unpause */
@@ -520,13 +1126,26 @@ void pause_play(buffer *buf, playlist *pl)
         file[0] = '\0';
         options.seek = seek;
         current_frame = 0;
-        printf("@P 2\n");
+        remote_state(2);
     }
 }
 
 /* seek to absolute frame frame */
 void seek(buffer *buf, signed long frame)
 {
+    /* see move() */
+    if (can_jump(buf))
+    {
+        if (frame < 0)
+            current_frame = 0;
+        else if (frame > buf->num_frames)
+            current_frame = buf->num_frames;
+        else
+            current_frame = frame;
+        status = MPG321_REWINDING;
+        return;
+    }
+
     if (frame > buf->num_frames)
         options.seek = buf->num_frames;
     else
@@ -540,6 +1159,25 @@ enum mad_flow move(buffer *buf, signed long frames)
     if (frames == 0)
         return 0;
     
+    /* HTTP and FTP streams the server will send from anywhere in go
+       straight to the frame, either way, with another request: a stop in
+       decoding, and a restart, in which read_from_fd() makes the request */
+    if (can_jump(buf))
+    {
+        if (((signed long)current_frame + frames) < 0)
+            current_frame = 0;
+        else if ((frames + current_frame) > buf->num_frames)
+            current_frame = buf->num_frames;
+        else
+            current_frame += frames;
+        status = MPG321_REWINDING;
+        return MAD_FLOW_STOP;
+    }
+
+    /* other streams have no table of times to go back with */
+    if (frames < 0 && !buf->times)
+        return 0;
+
     /* Our normal skipping (for -k) code handles forward seeks.
        Rewinds are handled by a stop in decoding, a rewind, and
        a restart in decoding, implemented in the main loop and in the other
@@ -551,6 +1189,9 @@ enum mad_flow move(buffer *buf, signed long frames)
 
     status = MPG321_SEEKING;
 
+    if (frames > 0 && buf->fd == -1 && !buf->window)
+        mmap_advise_seek(buf, current_frame + options.seek);
+
     /* Rewinding doesn't correct for frames on its own, so we must do so */
     if (frames < 0)
     {
@@ -566,12 +1207,57 @@ enum mad_flow move(buffer *buf, signed long frames)
     return 0;
 }
     
+/* calc_length() for files we won't map: huge ones, or ones on filesystems
+   where reading the whole thing for a VBR scan would take ages. Only the
+   start and end of the file are read, and scan() estimates the rest.
+   buf->length has been set to the size of the file. */
+static
+int calc_length_pread(int f, buffer *buf)
+{
+    unsigned char *data;
+    unsigned long datalen;
+    ssize_t len;
+
+    if (!(data = malloc(WINDOW_BATCH)))
+        return -1;
+
+    /* tags at the start */
+    if ((len = pread(f, data, WINDOW_BATCH, 0)) <= 0)
+    {
+        free(data);
+        return -1;
+    }
+
+    buf->offset = leading_tag_size(data, len, &datalen);
+
+    if (datalen && buf->offset + datalen < buf->length)
+        buf->length = buf->offset + datalen;
+
+    if (buf->offset >= buf->length)
+        buf->offset = 0;
+
+    /* tags at the end */
+    len = (buf->length - buf->offset < WINDOW_BATCH) ? buf->length - buf->offset : WINDOW_BATCH;
+
+    if (pread(f, data, len, buf->length - len) == len)
+        buf->length -= trailing_tag_size(data, len);
+
+    /* and the audio at the start */
+    len = (buf->length - buf->offset < WINDOW_BATCH) ? buf->length - buf->offset : WINDOW_BATCH;
+
+    if ((len = pread(f, data, len, buf->offset)) > 0)
+        scan(data, len, buf->length - buf->offset, buf);
+
+    free(data);
+
+    return 0;
+}
+
 int calc_length(char *file, buffer *buf)
 {
     int f;
     struct stat filestat;
     void *fdm;
-    char buffer[3];
 
     f = open(file, O_RDONLY);
 
@@ -595,28 +1281,28 @@ int calc_length(char *file, buffer *buf)
         return -1;
     }
 
-    /* TAG checking is adapted from XMMS */
     buf->length = filestat.st_size;
+    buf->offset = 0;
 
-    if (lseek(f, -128, SEEK_END) < 0)
+    if (filestat.st_size == 0)
     {
-        /* File must be very short or empty. Forget it. */
+        /* File is empty. Forget it. */
         close(f);
         return -1;
-    }    
+    }
 
-    if (read(f, buffer, 3) != 3)
+    if (use_window_input(f, filestat.st_size))
     {
+        int ret = calc_length_pread(f, buf);
+
+        if (ret < 0)
+            mpg321_error(file);
+
         close(f);
-        return -1;
-    }
-    
-    if (!strncmp(buffer, "TAG", 3))
-    {
-        buf->length -= 128; /* Correct for id3 tags */
+        return ret;
     }
-    
-    fdm = mmap(0, buf->length, PROT_READ, MAP_SHARED, f, 0);
+
+    fdm = mmap(0, filestat.st_size, PROT_READ, MAP_SHARED, f, 0);
     if (fdm == MAP_FAILED)
     {
         mpg321_error(file);
@@ -624,11 +1310,19 @@ int calc_length(char *file, buffer *buf)
         return -1;
     }
 
+#ifdef MADV_SEQUENTIAL
+    madvise(fdm, filestat.st_size, MADV_SEQUENTIAL);
+#endif
+
+    /* Step over tags and wrappers in one go from their size fields, rather
+       than having libmad resync through them a byte at a time */
+    find_audio_data(fdm, filestat.st_size, &buf->offset, &buf->length);
+
     /* Scan the file for a XING header, or calculate the length,
        or just scan the whole file and add everything up. */
-    scan(fdm, buf->length, buf);
+    scan(fdm + buf->offset, buf->length - buf->offset, buf->length - buf->offset, buf);
 
-    if (munmap(fdm, buf->length) == -1)
+    if (munmap(fdm, filestat.st_size) == -1)
     {
         mpg321_error(file);
         close(f);
@@ -721,6 +1415,16 @@ signed long audio_linear_dither(unsigned int bits, mad_fixed_t sample,
   return output >> scalebits;
 }
 
+/* Passes each frame about to be played on to the --serve listeners, as it
+   came */
+enum mad_flow filter(void *data, struct mad_stream const *stream, struct mad_frame *frame)
+{
+    if (server)
+        serve_frame(server, stream->this_frame, stream->next_frame - stream->this_frame);
+
+    return MAD_FLOW_CONTINUE;
+}
+
 enum mad_flow output(void *data,
                      struct mad_header const *header,
                      struct mad_pcm *pcm)
@@ -782,6 +1486,9 @@ enum mad_flow output(void *data,
         }
 
         ao_play(playdevice, stream, pcm->length * 4);
+
+        if (server)
+            serve_pcm(server, stream, pcm->length * 4, header->samplerate, 2);
     }
     
     else if (options.opt & MPG321_FORCE_STEREO)
@@ -806,6 +1513,9 @@ enum mad_flow output(void *data,
         }
 
         ao_play(playdevice, stream, pcm->length * 4);
+
+        if (server)
+            serve_pcm(server, stream, pcm->length * 4, header->samplerate, 2);
     }
         
     else /* Just straight mono output */
@@ -824,6 +1534,9 @@ enum mad_flow output(void *data,
 #endif
         }
         ao_play(playdevice, stream, pcm->length * 2);
+
+        if (server)
+            serve_pcm(server, stream, pcm->length * 2, header->samplerate, 1);
     }
 
     return MAD_FLOW_CONTINUE;        
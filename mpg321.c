@@ -54,8 +54,10 @@ int stop_playing_file = 0;
 int quit_now = 0;
 char *playlist_file;
 ao_device *playdevice=NULL;
+struct server *server = NULL;
 mad_timer_t current_time;
-mpg321_options options = { 0, NULL, NULL, 0 , 0, 0};
+mpg321_options options = { 0, NULL, NULL, 0 , 0, 0, 0, STREAM_BUFFER, { HIGH_WATERMARK_MS, 1 }, { 0, 0 },
+    CONNECT_TIMEOUT * 1000, NULL, RTP_JITTER, NULL, NULL, NULL, STATUS_INTERVAL };
 int status = MPG321_STOPPED;
 int file_change = 0;
 
@@ -80,12 +82,21 @@ void usage(char *argv0)
 {
     mpg123_boilerplate();
     fprintf(stderr,
-        "\nUsage: %s [options] file(s) | URL(s) | -\n\n"
+        "\nUsage: %s [options] file(s) | dir(s) | URL(s) | -\n\n"
         "Options supported:\n"
         "   --verbose or -v          Increase verbosity\n"
         "   --quiet or -q            Quiet mode (no title or boilerplate)\n"
         "   --gain N or -g N         Set gain (audio volume) to N (0-100)\n"
         "   --skip N or -k N         Skip N frames into the file\n"
+        "   --buffer N or -b N       Read ahead N Kbytes on streams and stdin\n"
+        "   --high-watermark N       Buffer N bytes (Nk, Nms) before playing a stream\n"
+        "   --low-watermark N        Rebuffer a stream when down to N bytes (Nk, Nms)\n"
+        "   --low-latency            Play streams from the first frame; no rebuffering\n"
+        "   --connect-timeout N      Give up connecting to a server after N seconds\n"
+        "   --proxy U or -p U        Fetch http:// URLs through proxy U (host:port)\n"
+        "   --jitter N               Wait up to N ms for RTP packets out of order\n"
+        "   --send U                 Send files as RTP to U (raw://host:port) instead\n"
+        "   --serve [H:]P            Serve what's played over HTTP on port P\n"
         "   --verbose or -v          Be more verbose in playing files\n"
         "   -o dt                    Set output devicetype to dt\n" 
     "                                [esd,alsa(09),arts,sun,oss]\n"
@@ -97,8 +108,13 @@ void usage(char *argv0)
         "   --test or -t             Test only; do no audio output\n"
         "   --list N or -@ N         Use playlist N as list of MP3 files\n"
         "   --random or -Z           Play files randomly until interrupted\n"
+        "   --seed N                 Seed --shuffle and --random with N, to repeat a run\n"
+        "   --validate               Check playlist entries ahead, passing over bad ones\n"
         "   --shuffle or -z          Shuffle list of files before playing\n"
         "   -R                       Use remote control interface\n"
+        "   --socket P               Use remote control interface on Unix socket P\n"
+        "   --status-interval N      Show -v or -R status every N ms (0: every frame)\n"
+        "   --remote-binary          Send -R output as binary records, not @ lines\n"
         "   --aggressive             Try to get higher priority\n"
         "   --help or --longhelp     Print this help screen\n"
         "   --version or -V          Print version information\n"
@@ -180,22 +196,13 @@ static int show_id3(struct id3_tag const *tag)
 
     if (options.opt & MPG321_REMOTE_PLAY)
     {
-        printf("@I ID3:");
+        remote_tag(names);
 
         for (i=0; i<=5; i++)
         {
-            if(!names[i])
-            {
-                printf(emptystring);
-            }
-            
-            else
-            {
-                printf("%s", names[i]);
+            if (names[i])
                 free(names[i]);
-            }
         }
-        printf("\n");
     }
     
     else
@@ -219,7 +226,9 @@ static int show_id3(struct id3_tag const *tag)
 int main(int argc, char *argv[])
 {
     int fd = 0;
-    char *currentfile, old_dir[PATH_MAX];
+    char *currentfile, *title, old_dir[PATH_MAX];
+    char stats[256];
+    struct sender *sender = NULL;
     playlist *pl = NULL;
     struct id3_file *id3struct = NULL;
     struct id3_tag *id3tag = NULL;
@@ -260,6 +269,28 @@ int main(int argc, char *argv[])
     if (shuffle_play)
         shuffle_files(pl);
 
+    /* not for -Z, which doesn't know what's coming up */
+    if ((options.opt & MPG321_VALIDATE) && !pl->random_play && !(options.opt & MPG321_REMOTE_PLAY))
+        pl->validator = validate_open();
+
+    if ((shuffle_play || pl->random_play) && (options.opt & MPG321_VERBOSE_PLAY))
+        fprintf(stderr, "Random seed: %u\n", pl->seed);
+
+    if (options.send && !(sender = sender_open(options.send)))
+    {
+        fprintf(stderr, "Nowhere to send to!\n");
+        exit(1);
+    }
+
+    if (options.serve)
+    {
+        if (!(server = serve_open(options.serve)))
+            exit(1);
+
+        if (!(options.opt & MPG321_QUIET_PLAY))
+            fprintf(stderr, "Serving on %s: /stream.mp3 and /stream.wav\n", options.serve);
+    }
+
     ao_initialize();
 
     check_default_play_device();
@@ -267,16 +298,17 @@ int main(int argc, char *argv[])
     if (!(options.opt & MPG321_REMOTE_PLAY))
     {
         handle_signals(-1); /* initialize signal handler */
-     
-        remote_input_buf[0] = '\0';
     }
     
     if (!(options.opt & MPG321_QUIET_PLAY)) 
         mpg123_boilerplate();
+
+    if ((options.opt & MPG321_VERBOSE_PLAY) && playlist_file)
+        show_playlist_length(pl);
     
     if (options.opt & MPG321_REMOTE_PLAY)
     {
-        printf ("@R MPG123\n");
+        remote_start();
     }
     
     /* Play the mpeg files or zip it! */
@@ -288,13 +320,25 @@ int main(int argc, char *argv[])
         signal(SIGINT, SIG_DFL);
         
         playbuf.buf = NULL;
+        playbuf.frames = NULL;
+        playbuf.times = NULL;
         playbuf.fd = -1;
+        playbuf.http = NULL;
+        playbuf.ftp = NULL;
+        playbuf.rtp = NULL;
+        playbuf.window = NULL;
         playbuf.length = 0;
+        playbuf.offset = 0;
+        playbuf.released = 0;
         playbuf.done = 0;
+        playbuf.buffering = 0;
+        playbuf.bitrate = 0;
         playbuf.num_frames = 0;
+        playbuf.has_toc = 0;
         playbuf.max_frames = -1;
         strncpy(playbuf.filename,currentfile, PATH_MAX);
         playbuf.filename[PATH_MAX-1] = '\0';
+        playbuf.listed_length = current_length(pl);
         
         if (status == MPG321_PLAYING) 
             file_change = 1;
@@ -303,7 +347,21 @@ int main(int argc, char *argv[])
         
         mad_timer_reset(&current_time);
 
-        if (!(options.opt & MPG321_QUIET_PLAY) && file_change)
+        /* --send passes on the frames of mmap()ed files only */
+        if (sender && (strstr(currentfile, "://") || strcmp(currentfile, "-") == 0))
+        {
+            fprintf(stderr, "%s: only local files can be sent\n", currentfile);
+            continue;
+        }
+
+        /* the playlist's title, if it gave one, rather than open the file
+           for its ID3 tag */
+        title = current_title(pl);
+
+        if (!(options.opt & MPG321_QUIET_PLAY) && file_change && title)
+            fprintf(stderr, "Title  : %s\n", title);
+
+        else if (!(options.opt & MPG321_QUIET_PLAY) && file_change)
         {
             id3struct = id3_file_open (currentfile, ID3_FILE_MODE_READONLY);
 
@@ -320,7 +378,10 @@ int main(int argc, char *argv[])
             }
         }
 
-        if (options.opt & MPG321_REMOTE_PLAY && file_change)
+        if (options.opt & MPG321_REMOTE_PLAY && file_change && title)
+            remote_info(REMOTE_INFO_NAME, title);
+
+        else if (options.opt & MPG321_REMOTE_PLAY && file_change)
         {
             id3struct = id3_file_open (currentfile, ID3_FILE_MODE_READONLY);
 
@@ -343,7 +404,7 @@ int main(int argc, char *argv[])
                         if (dot)
                             *dot = '\0';
                         
-                        printf("@I %s\n", basen);
+                        remote_info(REMOTE_INFO_NAME, basen);
 
                         free(basec);
                     }
@@ -368,7 +429,7 @@ int main(int argc, char *argv[])
                 if (dot)
                     *dot = '\0';
                 
-                printf("@I %s\n", basen);
+                remote_info(REMOTE_INFO_NAME, basen);
 
                 free(basec);
             }
@@ -376,14 +437,46 @@ int main(int argc, char *argv[])
 
         /* Create the MPEG stream */
         /* Check if source is on the network */
-        if((fd = raw_open(currentfile)) != 0 || (fd = http_open(currentfile)) != 0
-            || (fd = ftp_open(currentfile)) != 0)
+        if((playbuf.rtp = raw_open(currentfile)) != NULL || (playbuf.http = http_open(currentfile)) != NULL
+            || (playbuf.ftp = ftp_open(currentfile)) != NULL)
         {
+            if (playbuf.http)
+            {
+                fd = playbuf.http->fd;
+                if (playbuf.http->size > 0)
+                    playbuf.length = playbuf.http->size;
+            }
+            else if (playbuf.ftp)
+            {
+                fd = playbuf.ftp->data;
+                if (playbuf.ftp->size > 0)
+                    playbuf.length = playbuf.ftp->size;
+            }
+            else
+                fd = playbuf.rtp->fd;
+
+            /* nothing to scan for the length: take the playlist's word */
+            if (playbuf.listed_length)
+                mad_timer_set(&playbuf.duration, playbuf.listed_length, 0, 1);
+
             playbuf.fd = fd;
-            playbuf.buf = malloc(BUF_SIZE);
-            playbuf.length = BUF_SIZE;
+            playbuf.buffering = 1;
+
+            /* read ahead, so the decoder isn't left waiting on the network */
+            if (!(playbuf.window = window_open_stream(fd, options.buffersize, playbuf.http, playbuf.ftp, playbuf.rtp)))
+            {
+                mpg321_error(currentfile);
+
+                if (playbuf.http)
+                    http_close(playbuf.http);
+                else if (playbuf.ftp)
+                    ftp_close(playbuf.ftp);
+                else
+                    rtp_close(playbuf.rtp);
+                continue;
+            }
             
-            mad_decoder_init(&decoder, &playbuf, read_from_fd, read_header, /*filter*/0,
+            mad_decoder_init(&decoder, &playbuf, read_from_fd, read_header, filter,
                             output, /*error*/0, /* message */ 0);
         }
 
@@ -391,10 +484,14 @@ int main(int argc, char *argv[])
         else if(strcmp(currentfile, "-") == 0)
         {
             playbuf.fd = fileno(stdin);
-            playbuf.buf = malloc(BUF_SIZE);
-            playbuf.length = BUF_SIZE;
 
-            mad_decoder_init(&decoder, &playbuf, read_from_fd, read_header, /*filter*/0,
+            if (!(playbuf.window = window_open_stream(playbuf.fd, options.buffersize, NULL, NULL, NULL)))
+            {
+                mpg321_error(currentfile);
+                continue;
+            }
+
+            mad_decoder_init(&decoder, &playbuf, read_from_fd, read_header, filter,
                             output, /*error*/0, /* message */ 0);
         }
             
@@ -431,22 +528,41 @@ int main(int argc, char *argv[])
                 playbuf.max_frames = options.maxframes;
             }
             
-            playbuf.frames = malloc((playbuf.num_frames + 1) * sizeof(void*));
+            playbuf.frames = malloc((playbuf.num_frames + 1) * sizeof(off_t));
             playbuf.times = malloc((playbuf.num_frames + 1) * sizeof(mad_timer_t));
-    
-            if((playbuf.buf = mmap(0, playbuf.length, PROT_READ, MAP_SHARED, fd, 0))
-                                == MAP_FAILED)
+            playbuf.frames[0] = playbuf.offset;
+
+            /* Too big to map, or on a network filesystem: read it through
+               a window instead, unless it's to be sent on. The window owns
+               fd from here on. */
+            if (!sender && use_window_input(fd, stat.st_size))
             {
-                close(fd);
-                mpg321_error(currentfile);
-                continue;
+                if (!(playbuf.window = window_open(fd, playbuf.offset, playbuf.length)))
+                {
+                    close(fd);
+                    mpg321_error(currentfile);
+                    continue;
+                }
+
+                mad_decoder_init(&decoder, &playbuf, read_from_window, read_header, filter,
+                                output, /*error*/0, /* message */ 0);
             }
+
+            else
+            {
+                if((playbuf.buf = mmap(0, playbuf.length, PROT_READ, MAP_SHARED, fd, 0))
+                                    == MAP_FAILED)
+                {
+                    close(fd);
+                    mpg321_error(currentfile);
+                    continue;
+                }
             
-            close(fd);
-            playbuf.frames[0] = playbuf.buf;
+                close(fd);
             
-            mad_decoder_init(&decoder, &playbuf, read_from_mmap, read_header, /*filter*/0,
-                            output, /*error*/0, /* message */ 0);
+                mad_decoder_init(&decoder, &playbuf, read_from_mmap, read_header, filter,
+                                output, /*error*/0, /* message */ 0);
+            }
         }
 
         if(!(options.opt & MPG321_QUIET_PLAY))/*zip it!!!*/
@@ -489,12 +605,21 @@ int main(int argc, char *argv[])
            reinitialize it, and re-start it */
         while (1)
         {
+            if (sender)
+            {
+                send_file(&playbuf, sender);
+                break;
+            }
+
             mad_decoder_run(&decoder, MAD_DECODER_MODE_SYNC);
             
-            /* if we're rewinding on an mmap()ed stream */
-            if(status == MPG321_REWINDING && playbuf.fd == -1) 
+            /* if we're rewinding on an mmap()ed or windowed stream, or
+               jumping on an HTTP or FTP stream */
+            if(status == MPG321_REWINDING && (playbuf.fd == -1 || playbuf.http || playbuf.ftp)) 
             {
-                mad_decoder_init(&decoder, &playbuf, read_from_mmap, read_header, /*filter*/0,
+                mad_decoder_init(&decoder, &playbuf,
+                    (playbuf.http || playbuf.ftp) ? read_from_fd : playbuf.window ? read_from_window : read_from_mmap,
+                    read_header, filter,
                     output, /*error*/0, /* message */ 0);
             }    
             else
@@ -525,19 +650,55 @@ int main(int argc, char *argv[])
         if (playbuf.times)
             free(playbuf.times);
             
-        if (playbuf.fd == -1)
+        if (playbuf.window)
+        {
+            window_close(playbuf.window);
+        }
+
+        else if (playbuf.fd == -1)
         {
             munmap(playbuf.buf, playbuf.length);
         }
 
-        else
+        /* an HTTP or FTP connection can go back to the pool for the next
+           file */
+        if (playbuf.http)
+            http_close(playbuf.http);
+
+        else if (playbuf.ftp)
+            ftp_close(playbuf.ftp);
+
+        else if (playbuf.rtp)
         {
-            free(playbuf.buf);
-            if (playbuf.fd != fileno(stdin)) 
-                close(playbuf.fd);
+            if (rtp_stats(playbuf.rtp, stats, sizeof(stats)))
+            {
+                if (options.opt & MPG321_REMOTE_PLAY)
+                    remote_info(REMOTE_INFO_RTP, stats);
+                else if (!(options.opt & MPG321_QUIET_PLAY))
+                    fprintf(stderr, "RTP: %s\n", stats);
+            }
+            rtp_close(playbuf.rtp);
         }
+
+        else if (playbuf.fd != -1 && playbuf.fd != fileno(stdin))
+            close(playbuf.fd);
+    }
+
+    if (pl->validator)
+    {
+        validate_report(pl->validator);
+        validate_close(pl->validator);
     }
 
+    if (sender)
+        sender_close(sender);
+
+    if (server)
+        serve_close(server);
+
+    if (options.opt & MPG321_REMOTE_PLAY)
+        remote_close();
+
     if(playdevice)
         ao_close(playdevice);
 
@@ -33,6 +33,8 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
 #include <stdio.h>
 #include <limits.h>
 #include <ao/ao.h>
@@ -41,37 +43,336 @@
 #define FAKEVERSION "0.59q"
 #define VERSIONDATE "2002/03/23"
 
+/* The search for files to play in a directory given to play; see walk.c */
+struct walk;
+
+/* The checking of playlist entries ahead of play; see validate.c */
+struct validator;
+
+/* A playlist entry: the directory it's in, and its name after that in
+   the playlist's arena; and the title and length (in seconds) the
+   playlist gave it, if it did, or 0 */
+typedef struct
+{
+    size_t name;
+    size_t title;
+    int dir;
+    int length;
+} playlist_entry;
+
 /* playlist structure */
 typedef struct pl
 {
-    char **files;
+    /* every name and directory, one after another, each ending in a nul */
+    char *arena;
+    size_t arena_len;
+    size_t arena_size;
+
+    playlist_entry *files;
     int numfiles;
     int files_size;
+
+    /* the directories (as arena offsets), with a hash of them to find one
+       by; many files share each, and directory 0 is "" */
+    size_t *dirs;
+    int numdirs;
+    int dirs_size;
+    int *dir_hash;
+    int dir_hash_size;
+
+    /* a playlist file still being read, a block at a time, and the
+       directory its relative names are in */
+    int fd;
+    char *block;
+    size_t block_len;
+    int skip_line;
+    char *directory;
+
+    /* whether it's a pipe (or the like), read as it's written to */
+    int streaming;
+
+    /* -v: show its total length once it's all been read */
+    int show_length;
+
+    /* lines read, and whether it's a PLS playlist and if so where its
+       File1 is; and an #EXTINF's title and length, for the next name */
+    int lines;
+    int pls;
+    int pls_first;
+    size_t next_title;
+    int next_length;
+
     int random_play;
+
+    /* what random() was seeded with, and for -Z how far through this
+       round's random order it is, and the keys of that order */
+    unsigned int seed;
+    unsigned long random_pos;
+    int random_bits;
+    unsigned long random_keys[4];
+
+    /* a directory being searched for files to play, which are played
+       before going on to the next entry, and whether the directories in
+       the playlist have been searched all at once to shuffle */
+    struct walk *walk;
+    int expanded;
+
+    /* --validate: what's checking entries ahead, and the next to check */
+    struct validator *validator;
+    int validated;
+
+    /* the next entry to give out */
+    int next;
+
+    /* the entry last given out (-1 if it was found in a directory), and
+       its name in full */
+    int current;
+    char path[PATH_MAX];
     char remote_file[PATH_MAX];
 } playlist;
 
+#define HTTP_BUF_SIZE 8192 /* Buffer for HTTP headers and framing */
+#define ICY_META_SIZE (16 * 255 + 1) /* Longest ICY metadata block, and a NUL */
+
+/* An HTTP connection, and how far we are into the body of the response */
+struct http
+{
+    /* connected to host:port, which is the proxy if there is one */
+    int fd;
+    char host[256];
+    int port;
+
+    /* what was asked for, and of whom, so it can be asked for again from
+       elsewhere in the file */
+    char server[256];
+    int server_port;
+    char path[PATH_MAX];
+
+    /* read from the connection but not used yet: headers, chunk sizes,
+       and the start of the body */
+    unsigned char buf[HTTP_BUF_SIZE];
+    size_t pos, len;
+
+    /* body left to read, of all of it or of this chunk; -1 for until the
+       server closes the connection */
+    off_t left;
+    int chunked;
+    int last_chunk;
+
+    /* the whole body has been read */
+    int ended;
+
+    /* the server will take another request on the connection, and has
+       had one on it already */
+    int keepalive;
+    int reused;
+
+    /* the server will send part of the file (Accept-Ranges: bytes); the
+       size of the whole file, or -1; where in it the body started, and
+       where the next byte of it is from */
+    int ranges;
+    off_t size;
+    off_t start;
+    off_t offset;
+
+    /* the connection dropped before the end of the body, and how many
+       times in a row we've tried to carry on from there */
+    int truncated;
+    int retries;
+
+    /* ICY metadata comes every metaint bytes of audio, or 0 for never:
+       audio till the next block, and what's left of the block being read
+       (-1 when its length byte is next) */
+    unsigned long metaint;
+    unsigned long audio_left;
+    int meta_left;
+    size_t meta_len;
+    char meta[ICY_META_SIZE];
+
+    /* the last block that wasn't empty, and whether it's new */
+    char icy[ICY_META_SIZE];
+    int icy_changed;
+
+    /* what http_want() last asked for */
+    int target;
+    unsigned char *dst;
+    size_t room;
+};
+
+#define FTP_BUF_SIZE 2048 /* Buffer for FTP control connection replies */
+
+/* An FTP control connection, and the transfer going on over it */
+struct ftp
+{
+    /* connected to host:port, logged in as user */
+    int fd;
+    char host[256];
+    int port;
+    char user[128];
+    char pass[128];
+
+    /* read from the control connection but not used yet, and the last
+       line of the last reply */
+    unsigned char buf[FTP_BUF_SIZE];
+    size_t pos, len;
+    char reply[512];
+
+    /* the server doesn't know EPSV, or PASV, so don't ask it again */
+    int no_epsv;
+    int no_pasv;
+
+    /* has been used for a file before */
+    int reused;
+
+    /* the data connection, or -1; the file coming over it, its size from
+       SIZE or -1, and where in it the next byte is from */
+    int data;
+    char path[PATH_MAX];
+    off_t size;
+    off_t offset;
+
+    /* how many times in a row we've tried to carry on after the data
+       connection dropped */
+    int retries;
+};
+
+#define RTP_SLOTS 64 /* Packets the jitter buffer can hold */
+#define RTP_PACKET 2048 /* Biggest datagram taken from a raw:// stream */
+#define RTP_BATCH 16 /* Most datagrams to take from the socket at a time */
+
+/* A datagram held in the jitter buffer, till it's its turn */
+struct rtp_slot
+{
+    int held;
+    unsigned short seq;
+    long arrived;
+
+    /* MPEG audio in data, past the headers; and whether it carries on a
+       frame started in an earlier packet */
+    size_t start, len;
+    int fragment;
+
+    unsigned char data[RTP_PACKET];
+};
+
+/* A raw:// UDP stream. If it's RTP, packets are held long enough to put
+   them back in order, and ones that don't turn up are made up for. */
+struct rtp
+{
+    int fd;
+
+    /* the stream is RTP, or just MPEG audio in datagrams, or -1 till the
+       first one says; the source it's from */
+    int is_rtp;
+    int started;
+    unsigned long ssrc;
+
+    /* sequence numbers: the next to pass on, and the highest seen; how
+       many packets are held. Plain datagrams are numbered as they come. */
+    unsigned short next, highest;
+    int held;
+    struct rtp_slot slots[RTP_SLOTS];
+
+    /* what rtp_recv() reads into */
+    unsigned char batch[RTP_BATCH][RTP_PACKET];
+
+    /* being passed on: a packet's payload, or a repeat of the last for
+       a lost one */
+    unsigned char *out;
+    size_t out_pos, out_len;
+    int concealing;
+
+    /* the last packet that started with a frame, and whether one has been
+       lost since */
+    unsigned char last[RTP_PACKET];
+    size_t last_len;
+    int broken;
+
+    unsigned long received, lost, reordered, late, duplicate, concealed;
+};
+
+#define SEND_MAX_DESTS 8 /* Most --send destinations */
+#define SEND_PAYLOAD 1400 /* Most MPEG audio per datagram sent; bigger frames are split */
+#define SEND_BATCH 16 /* Datagrams gathered for each sendmmsg() */
+
+/* Where --send sends to, and the RTP stream sent so far */
+struct sender
+{
+    /* IPv4 and IPv6 sockets, or -1 if there's nowhere to send with one */
+    int fd[2];
+    struct sockaddr_storage dest[SEND_MAX_DESTS];
+    socklen_t dest_len[SEND_MAX_DESTS];
+    int ndests;
+
+    unsigned short seq;
+    unsigned long ssrc;
+    unsigned long timestamp;
+
+    /* when sending started, by now_ms(), and how far into the stream it
+       is in playing time */
+    long start;
+    mad_timer_t sent;
+
+    /* datagrams waiting for the next sendmmsg() */
+    unsigned char packets[SEND_BATCH][16 + SEND_PAYLOAD];
+    size_t len[SEND_BATCH];
+    int npackets;
+};
+
+#define SERVE_RING (1024 * 1024) /* Bytes of what's been played kept for --serve listeners */
+#define SERVE_MAX_LISTENERS 64 /* Most --serve listeners at once */
+
+/* The --serve HTTP server; see serve.c */
+struct server;
+
 /* Private buffer for passing around with libmad */
 typedef struct
 {
     /* The buffer of raw mpeg data for libmad to decode */
     void * buf;
 
-    /* Cached data: pointers to the dividing points of frames
-       in buf, and the playing time at each of those frames */
-    void **frames;
+    /* Cached data: file offsets of the dividing points of frames,
+       and the playing time at each of those frames */
+    off_t *frames;
     mad_timer_t *times;
 
     /* fd is the file descriptor if over the network, or -1 if
-       using mmap()ed files */
+       using mmap()ed files or a window */
     int fd;
 
+    /* the HTTP connection the stream is coming over, or NULL */
+    struct http *http;
+
+    /* the FTP transfer the stream is coming over, or NULL */
+    struct ftp *ftp;
+
+    /* the raw:// stream being received, or NULL */
+    struct rtp *rtp;
+
+    /* windowed pread() input, or NULL. Used instead of mmap() for very
+       big files, and files on network filesystems, and to read ahead on
+       network streams and stdin */
+    struct window *window;
+
     /* length of the current stream, corrected for id3 tags */
-    ssize_t length;
+    off_t length;
+
+    /* offset of the first byte of audio, past any ID3v2/APE tags or
+       RIFF header at the start of the stream */
+    off_t offset;
+
+    /* mmap()ed files only: how much of buf we've told the kernel it
+       can drop, now that it has been played */
+    ssize_t released;
 
     /* have we finished fetching this file? (only in non-mmap()'ed case */
     int done;
 
+    /* network streams: waiting for the high watermark before playing on,
+       and the bitrate of the last frame, to turn milliseconds into bytes */
+    int buffering;
+    unsigned long bitrate;
+
     /* total number of frames */
     unsigned long num_frames;
 
@@ -81,6 +382,14 @@ typedef struct
     /* total duration of the file */
     mad_timer_t duration;
 
+    /* the length in seconds the playlist gave the file, or 0 */
+    long listed_length;
+
+    /* the Xing TOC, if there is one: where in the file, in 256ths,
+       each percent of the way through it starts */
+    unsigned char toc[100];
+    int has_toc;
+
     /* filename as mpg321 has opened it */
     char filename[PATH_MAX];
     
@@ -88,6 +397,14 @@ typedef struct
     playlist *pl;
 } buffer;
 
+/* An amount of network input to have buffered: bytes, or milliseconds of
+   audio */
+typedef struct
+{
+    signed long amount;
+    int ms;
+} watermark;
+
 typedef struct
 {
     int opt;
@@ -97,17 +414,27 @@ typedef struct
     signed long maxframes;
     int volume;
     int skip_printing_frames;
+    signed long buffersize;
+    watermark high_watermark;
+    watermark low_watermark;
+    long connect_timeout;
+    char *proxy;
+    int jitter;
+    char *send;
+    char *serve;
+    char *remote_socket;
+    long status_interval;
 } mpg321_options;    
 
 extern mpg321_options options;
 extern ao_device *playdevice;
+extern struct server *server;
 extern mad_timer_t current_time;
 extern unsigned long current_frame;
 extern int stop_playing_file;
 extern int shuffle_play;
 extern char *playlist_file;
 extern int quit_now;
-extern char remote_input_buf[PATH_MAX + 5];
 extern int file_change;
 
 extern int status;
@@ -140,11 +467,41 @@ enum
     MPG321_USE_USERDEF   = 0x00004000,
     MPG321_USE_ALSA09    = 0x00008000,
     
-    MPG321_FORCE_STEREO  = 0x00010000
+    MPG321_FORCE_STEREO  = 0x00010000,
+
+    MPG321_VALIDATE      = 0x00020000,
+    MPG321_REMOTE_BINARY = 0x00040000
+};
+
+/* What an @I line, or a binary 'I' record, tells of; see remote_info() */
+enum
+{
+    REMOTE_INFO_NAME,
+    REMOTE_INFO_ID3,
+    REMOTE_INFO_ICY,
+    REMOTE_INFO_RTP
 };
 
 #define DEFAULT_PLAYLIST_SIZE 1024
-#define BUF_SIZE 1048576 /* Size for read buffer for audio data */
+#define PLAYLIST_BLOCK 65536 /* Size of each read() of a playlist file */
+#define PLAYLIST_LOOKAHEAD 64 /* Entries read ahead of play from a piped playlist */
+#define WALK_THREADS 4 /* Threads looking for files in a directory to play */
+#define WALK_BUF_SIZE 32768 /* Size of each getdents64() */
+#define VALIDATE_THREADS 4 /* Threads checking playlist entries; see --validate */
+#define VALIDATE_AHEAD 32 /* ... and how many entries ahead of play they check */
+#define VALIDATE_SNIFF 16384 /* Bytes after any tags to look for a frame header in */
+#define REMOTE_RING 16384 /* Bytes of -R commands read and not yet acted on */
+#define REMOTE_CLIENTS 16 /* Most clients of the --socket remote control at once */
+#define REMOTE_CLIENT_BUF 65536 /* ... and how much not yet read by each is kept */
+#define MMAP_WINDOW 262144 /* mmap()ed files are given to libmad this much at a time */
+#define MMAP_AHEAD 2 /* ... and we ask the kernel to read this many windows ahead */
+#define WINDOW_BATCH 1048576 /* Size of each pread() for windowed input */
+#define WINDOW_BATCHES 4 /* Number of them to keep in memory / in flight */
+#define STREAM_BUFFER 1048576 /* Default read-ahead for streams; see --buffer */
+#define HIGH_WATERMARK_MS 500 /* Default network input to buffer before playing */
+#define CONNECT_TIMEOUT 10 /* Default seconds to wait for a connection; see --connect-timeout */
+#define RTP_JITTER 100 /* Default ms to wait for RTP packets out of order; see --jitter */
+#define STATUS_INTERVAL 100 /* Default ms between status lines; see --status-interval */
 
 /* playlist functions */
 playlist * new_playlist();
@@ -153,29 +510,93 @@ char * get_next_file(playlist *pl, buffer *buf);
 void add_cmdline_files(playlist *pl, char *argv[]);
 void add_file(playlist *pl, char *file);
 void load_playlist(playlist *pl, char *filename);
+void playlist_poll(playlist *pl);
 void set_random_play(playlist *pl);
 void play_remote_file(playlist *pl, char *filename);
 void clear_remote_file(playlist *pl);
 void shuffle_files(playlist *pl);
+void set_random_seed(playlist *pl, unsigned int seed);
+char * current_title(playlist *pl);
+long current_length(playlist *pl);
+void show_playlist_length(playlist *pl);
 void trim_whitespace(char *);
 
 /* network functions */
+long now_ms(void);
 int tcp_open(char * address, int port);
 int udp_open(char * address, int port);
-int raw_open(char * arg);
-int http_open(char * arg);
-int ftp_open(char * arg);
+int tcp_listen(char * arg);
+int unix_listen(char *path);
+struct rtp * raw_open(char * arg);
+void rtp_close(struct rtp *r);
+int rtp_recv(struct rtp *r);
+size_t rtp_take(struct rtp *r, unsigned char *dst, size_t room);
+int rtp_wait(struct rtp *r);
+int rtp_stats(struct rtp *r, char *buf, size_t size);
+struct sender * sender_open(char *list);
+void sender_frame(struct sender *s, unsigned char const *frame, size_t len, mad_timer_t duration);
+void sender_flush(struct sender *s);
+void sender_close(struct sender *s);
+struct http * http_open(char * arg);
+void http_close(struct http *h);
+int http_want(struct http *h, unsigned char *dst, size_t room, struct iovec *iov);
+ssize_t http_got(struct http *h, ssize_t got);
+int http_reopen(struct http *h, off_t pos);
+int http_resume(struct http *h);
+struct ftp * ftp_open(char * arg);
+void ftp_close(struct ftp *f);
+int ftp_reopen(struct ftp *f, off_t pos);
+int ftp_resume(struct ftp *f);
+
+/* directory search functions */
+struct walk * walk_open(char *dir);
+int walk_next(struct walk *w, char *path, size_t size);
+void walk_close(struct walk *w);
+
+/* playlist checking functions */
+struct validator * validate_open(void);
+int validate_room(struct validator *v, int next);
+void validate_add(struct validator *v, int index, char *path);
+int validate_result(struct validator *v, int index);
+void validate_report(struct validator *v);
+void validate_close(struct validator *v);
+
+/* HTTP server functions */
+struct server * serve_open(char *arg);
+void serve_frame(struct server *s, unsigned char const *frame, size_t len);
+void serve_pcm(struct server *s, unsigned char const *pcm, size_t len, int rate, int channels);
+void serve_close(struct server *s);
 
 /* libmad interfacing functions */
 enum mad_flow read_from_mmap(void *data, struct mad_stream *stream);
 enum mad_flow read_from_fd(void *data, struct mad_stream *stream);
 enum mad_flow read_header(void *data, struct mad_header const * header);
+enum mad_flow filter(void *data, struct mad_stream const *stream, struct mad_frame *frame);
 enum mad_flow output(void *data, struct mad_header const *header, struct mad_pcm *pcm);
 int calc_length(char *file, buffer*buf );
+unsigned long leading_tag_size(unsigned char const *p, unsigned long avail, unsigned long *datalen);
+unsigned long trailing_tag_size(unsigned char const *data, unsigned long len);
+void find_audio_data(unsigned char const *data, off_t len, off_t *start, off_t *end);
+void scan(void const *ptr, ssize_t len, off_t total, buffer *buf);
+void send_file(buffer *playbuf, struct sender *s);
 
 enum mad_flow move(buffer *buf, signed long frames);
 void seek(buffer *buf, signed long frame);
 void pause_play(buffer *buf, playlist *pl);
+char * modestringucase(enum mad_mode mode);
+
+/* windowed pread() input, and read-ahead for streams */
+int use_window_input(int fd, off_t size);
+struct window * window_open(int fd, off_t start, off_t end);
+struct window * window_open_stream(int fd, size_t size, struct http *http, struct ftp *ftp, struct rtp *rtp);
+void window_close(struct window *w);
+void window_poll(struct window *w);
+ssize_t window_refill(struct window *w, struct mad_stream *stream, size_t want);
+ssize_t window_ahead(struct window *w);
+int window_reposition(struct window *w, off_t pos);
+int window_seekable(struct window *w);
+int window_metadata(struct window *w, char *buf, size_t size);
+enum mad_flow read_from_window(void *data, struct mad_stream *stream);
 
 /* libao interfacing and general audio-out functions */
 void check_ao_default_play_device();
@@ -184,6 +605,15 @@ int playdevice_is_live();
 void open_ao_playdevice(struct mad_header const *header);
 
 /* remote control (-R) functions */
+void remote_start(void);
+void remote_state(int state);
+void remote_buffering(int buffering);
+void remote_info(int kind, char *text);
+void remote_tag(char **names);
+void remote_stream(struct mad_header const *header);
+void remote_frame(long frame, long frames_left, mad_timer_t time, mad_timer_t time_left);
+void remote_flush(void);
+void remote_close(void);
 void remote_get_input_wait(buffer *buf);
 enum mad_flow remote_get_input_nowait(buffer *buf);
 
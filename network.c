@@ -22,13 +22,17 @@
 */
 
 #define _LARGEFILE_SOURCE 1
+#define _GNU_SOURCE 1 /* recvmmsg() */
 
 #include "mpg321.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <errno.h>
+#include <stdarg.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
@@ -38,9 +42,12 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <arpa/inet.h>
 
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 
 #include <limits.h>
 
@@ -51,375 +58,2289 @@ int is_address_multicast(unsigned long address)
     return (0);
 }
 
-int tcp_open(char *address, int port)
+/* How many hosts' addresses to keep, and for how long in seconds */
+#define DNS_CACHE_SIZE 8
+#define DNS_CACHE_TTL 60
+
+/* Most addresses of a host to try connecting to, and how long in ms to
+   give each before trying the next one alongside it */
+#define CONNECT_MAX_ADDRS 16
+#define CONNECT_ATTEMPT_DELAY 250
+
+static struct
 {
-    struct sockaddr_in stAddr;
-    struct hostent *host;
-    int sock;
-    struct linger l;
+    char host[256];
+    int socktype;
+    time_t when;
+    struct addrinfo *ai;
+} dns_cache[DNS_CACHE_SIZE];
+
+/* The addresses of host, IPv4 and IPv6, looked up again only if it's been
+   a while; so a playlist of files on one server is looked up once. The
+   list belongs to the cache. */
+static struct addrinfo *resolve(char *host, int socktype)
+{
+    struct addrinfo hints, *ai;
+    time_t now = time(NULL);
+    int i, slot = -1;
+    int e;
 
-    memset(&stAddr, 0, sizeof(stAddr));
-    stAddr.sin_family = AF_INET;
-    stAddr.sin_port = htons(port);
+    for (i = 0; i < DNS_CACHE_SIZE; i++)
+    {
+        if (dns_cache[i].ai && dns_cache[i].socktype == socktype
+            && strcmp(dns_cache[i].host, host) == 0)
+        {
+            if (now - dns_cache[i].when < DNS_CACHE_TTL)
+                return dns_cache[i].ai;
 
-    if ((host = gethostbyname(address)) == NULL)
-        return (0);
+            slot = i;
+            break;
+        }
 
-    stAddr.sin_addr = *((struct in_addr *)host->h_addr_list[0]);
+        /* an empty slot, or else the oldest */
+        if (slot == -1 || (dns_cache[slot].ai
+                && (!dns_cache[i].ai || dns_cache[i].when < dns_cache[slot].when)))
+            slot = i;
+    }
 
-    if ((sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
-        return (0);
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = socktype;
+#ifdef AI_ADDRCONFIG
+    hints.ai_flags = AI_ADDRCONFIG;
+#endif
+
+    if ((e = getaddrinfo(host, NULL, &hints, &ai)) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(e));
+        errno = EHOSTUNREACH;
+        return NULL;
+    }
 
-    l.l_onoff = 1;
-    l.l_linger = 5;
-    if (setsockopt(sock, SOL_SOCKET, SO_LINGER, (char *)&l, sizeof(l)) < 0)
+    if (dns_cache[slot].ai)
+        freeaddrinfo(dns_cache[slot].ai);
+
+    snprintf(dns_cache[slot].host, sizeof(dns_cache[slot].host), "%s", host);
+    dns_cache[slot].socktype = socktype;
+    dns_cache[slot].when = now;
+    dns_cache[slot].ai = ai;
+
+    return ai;
+}
+
+/* ai's address, with port, into addr. Returns its length. */
+static socklen_t address_port(struct addrinfo *ai, int port, struct sockaddr_storage *addr)
+{
+    memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+
+    if (ai->ai_family == AF_INET6)
+        ((struct sockaddr_in6 *)addr)->sin6_port = htons(port);
+    else
+        ((struct sockaddr_in *)addr)->sin_port = htons(port);
+
+    return ai->ai_addrlen;
+}
+
+long now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec * 1000L + tv.tv_usec / 1000;
+}
+
+/* Connect to host:port, trying its addresses IPv6 and IPv4 in turn, each
+   with a head start of CONNECT_ATTEMPT_DELAY on the next (RFC 8305, "happy
+   eyeballs"), and giving up after options.connect_timeout ms. Returns the
+   first socket to connect, or 0. */
+int tcp_open(char *address, int port)
+{
+    struct addrinfo *list, *ai, *addrs[CONNECT_MAX_ADDRS];
+    struct addrinfo *first[CONNECT_MAX_ADDRS], *other[CONNECT_MAX_ADDRS];
+    struct sockaddr_storage addr;
+    struct pollfd fds[CONNECT_MAX_ADDRS];
+    int n = 0, na = 0, nb = 0, tried = 0, live = 0, sock = 0;
+    int i, j, s, err = ETIMEDOUT;
+    long now, deadline, next_try;
+    socklen_t len;
+
+    if (!(list = resolve(address, SOCK_STREAM)))
         return (0);
 
-    if (connect(sock, (struct sockaddr *)&stAddr, sizeof(stAddr)) < 0)
+    /* alternate between families, starting with the first one given */
+    for (ai = list; ai; ai = ai->ai_next)
+    {
+        if (ai->ai_family == list->ai_family)
+        {
+            if (na < CONNECT_MAX_ADDRS)
+                first[na++] = ai;
+        }
+        else if (nb < CONNECT_MAX_ADDRS)
+            other[nb++] = ai;
+    }
+
+    for (i = 0; n < CONNECT_MAX_ADDRS && (i < na || i < nb); i++)
+    {
+        if (i < na)
+            addrs[n++] = first[i];
+        if (i < nb && n < CONNECT_MAX_ADDRS)
+            addrs[n++] = other[i];
+    }
+
+    now = now_ms();
+    deadline = now + options.connect_timeout;
+    next_try = now;
+
+    while (!sock)
+    {
+        now = now_ms();
+
+        /* start on the next address once the last has had its head start,
+           or has failed */
+        if (tried < n && (live == 0 || now >= next_try))
+        {
+            ai = addrs[tried++];
+            next_try = now + CONNECT_ATTEMPT_DELAY;
+
+            if ((s = socket(ai->ai_family, SOCK_STREAM, IPPROTO_TCP)) < 0)
+            {
+                err = errno;
+                continue;
+            }
+
+            fcntl(s, F_SETFL, fcntl(s, F_GETFL) | O_NONBLOCK);
+            len = address_port(ai, port, &addr);
+
+            if (connect(s, (struct sockaddr *)&addr, len) == 0)
+                sock = s;
+            else if (errno == EINPROGRESS)
+            {
+                fds[live].fd = s;
+                fds[live].events = POLLOUT;
+                live++;
+            }
+            else
+            {
+                err = errno;
+                close(s);
+            }
+
+            continue;
+        }
+
+        if ((live == 0 && tried == n) || now >= deadline)
+            break;
+
+        i = poll(fds, live, (tried < n && next_try < deadline ? next_try : deadline) - now);
+
+        if (i < 0 && errno != EINTR)
+        {
+            err = errno;
+            break;
+        }
+
+        for (i = 0; i < live && !sock; i++)
+        {
+            if (!fds[i].revents)
+                continue;
+
+            len = sizeof(j);
+            if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &j, &len) < 0)
+                j = errno;
+
+            if (j == 0)
+            {
+                sock = fds[i].fd;
+                fds[i] = fds[--live];
+                break;
+            }
+
+            /* that one's failed: give the next its turn now */
+            err = j;
+            close(fds[i].fd);
+            fds[i--] = fds[--live];
+            next_try = now;
+        }
+    }
+
+    for (i = 0; i < live; i++)
+        close(fds[i].fd);
+
+    if (!sock)
+    {
+        errno = err;
         return (0);
+    }
+
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
 
     return (sock);
 }
 
 int udp_open(char *address, int port)
 {
-    int enable = 1L;
-    struct sockaddr_in stAddr;
-    struct sockaddr_in stLclAddr;
+    int enable = 1;
+    struct addrinfo *ai;
+    struct sockaddr_storage stAddr;
+    struct sockaddr_storage stLclAddr;
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
     struct ip_mreq stMreq;
-    struct hostent *host;
+    struct ipv6_mreq stMreq6;
     int sock;
 
-    stAddr.sin_family = AF_INET;
-    stAddr.sin_port = htons(port);
-
-    if ((host = gethostbyname(address)) == NULL)
+    if (!(ai = resolve(address, SOCK_DGRAM)))
         return (0);
 
-    stAddr.sin_addr = *((struct in_addr *)host->h_addr_list[0]);
+    address_port(ai, port, &stAddr);
 
     /* Create a UDP socket */
-    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+    if ((sock = socket(ai->ai_family, SOCK_DGRAM, 0)) < 0)
         return (0);
 
     /* Allow multiple instance of the client to share the same address and port */
-    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&enable, sizeof(unsigned long int)) < 0)
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&enable, sizeof(enable)) < 0)
         return (0);
 
+    memset(&stLclAddr, 0, sizeof(stLclAddr));
+
+    if (ai->ai_family == AF_INET6)
+    {
+        sin6 = (struct sockaddr_in6 *)&stLclAddr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = in6addr_any;
+
+        /* If the address is multicast, bind to its port and register to
+           the group; otherwise to any port */
+        if (IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)&stAddr)->sin6_addr))
+        {
+            sin6->sin6_port = htons(port);
+            if (bind(sock, (struct sockaddr *)sin6, sizeof(*sin6)) < 0)
+                return (0);
+
+            stMreq6.ipv6mr_multiaddr = ((struct sockaddr_in6 *)&stAddr)->sin6_addr;
+            stMreq6.ipv6mr_interface = 0;
+            if (setsockopt(sock, IPPROTO_IPV6, IPV6_JOIN_GROUP, (char *)&stMreq6, sizeof(stMreq6)) < 0)
+                return (0);
+        }
+        else
+        {
+            sin6->sin6_port = htons(port);
+            if (bind(sock, (struct sockaddr *)sin6, sizeof(*sin6)) < 0)
+                return (0);
+        }
+
+        return (sock);
+    }
+
+    sin = (struct sockaddr_in *)&stLclAddr;
+
     /* If the address is multicast, register to the multicast group */
-    if (is_address_multicast(stAddr.sin_addr.s_addr))
+    if (is_address_multicast(((struct sockaddr_in *)&stAddr)->sin_addr.s_addr))
     {
         /* Bind the socket to port */
-        stLclAddr.sin_family = AF_INET;
-        stLclAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-        stLclAddr.sin_port = stAddr.sin_port;
-        if (bind(sock, (struct sockaddr *)&stLclAddr, sizeof(stLclAddr)) < 0)
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(INADDR_ANY);
+        sin->sin_port = htons(port);
+        if (bind(sock, (struct sockaddr *)sin, sizeof(*sin)) < 0)
             return (0);
 
         /* Register to a multicast address */
-        stMreq.imr_multiaddr.s_addr = stAddr.sin_addr.s_addr;
+        stMreq.imr_multiaddr.s_addr = ((struct sockaddr_in *)&stAddr)->sin_addr.s_addr;
         stMreq.imr_interface.s_addr = INADDR_ANY;
         if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *)&stMreq, sizeof(stMreq)) < 0)
             return (0);
     }
     else
     {
-        /* Bind the socket to port */
-        stLclAddr.sin_family = AF_INET;
-        stLclAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-        stLclAddr.sin_port = htons(0);
-        if (bind(sock, (struct sockaddr *)&stLclAddr, sizeof(stLclAddr)) < 0)
+        /* Bind the socket to port, for a stream sent straight to us */
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(INADDR_ANY);
+        sin->sin_port = htons(port);
+        if (bind(sock, (struct sockaddr *)sin, sizeof(*sin)) < 0)
             return (0);
     }
 
     return (sock);
 }
 
-int raw_open(char *arg)
+/* Split host[:port], or [v6 address][:port], at the colon; port is left
+   alone if there isn't one. Returns the host. */
+static char *host_port(char *host, int *port)
 {
-    char *host;
-    int port;
-    int sock;
+    char *colon;
 
-    /* Check for URL syntax */
-    if (strncmp(arg, "raw://", strlen("raw://")))
-        return (0);
+    if (host[0] == '[' && (colon = strchr(host, ']')))
+    {
+        *colon++ = 0;
+        host++;
+    }
+    else
+        colon = strchr(host, ':');
 
-    /* Parse URL */
-    port = 0;
-    host = arg + strlen("raw://");
-    if (strchr(host, ':') != NULL)  /* port is specified */
+    if (colon && *colon == ':')  /* port is specified */
     {
-        port = atoi(strchr(host, ':') + 1);
-        *strchr(host, ':') = 0;
+        *colon = 0;
+        *port = atoi(colon + 1);
     }
 
-    /* Open a UDP socket */
-    if (!(sock = udp_open(host, port)))
-        perror("raw_open");
+    return host;
+}
 
-    return (sock);
+/* Listen for TCP connections on [host:]port; on any address if there's
+   no host. Returns the socket, or -1. */
+int tcp_listen(char *arg)
+{
+    struct addrinfo hints, *list, *ai;
+    char *host = NULL;
+    char service[16];
+    int port = 0;
+    int enable = 1;
+    int sock = -1;
+    int e;
+
+    if (arg[strspn(arg, "0123456789")])
+        host = host_port(arg, &port);
+    else
+        port = atoi(arg);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+
+    snprintf(service, sizeof(service), "%d", port);
+
+    if ((e = getaddrinfo(host, service, &hints, &list)) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", host ? host : arg, gai_strerror(e));
+        return -1;
+    }
+
+    for (ai = list; ai; ai = ai->ai_next)
+    {
+        if ((sock = socket(ai->ai_family, SOCK_STREAM, 0)) < 0)
+            continue;
+
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (char *)&enable, sizeof(enable));
+
+        if (bind(sock, ai->ai_addr, ai->ai_addrlen) == 0 && listen(sock, SOMAXCONN) == 0)
+            break;
+
+        close(sock);
+        sock = -1;
+    }
+
+    if (sock == -1)
+        perror("tcp_listen");
+
+    freeaddrinfo(list);
+
+    return sock;
 }
 
-/**
- * Read a http line header.
- * This function read character by character.
- * @param tcp_sock the socket use to read the stream
- * @param buf a buffer to receive the data
- * @param size size of the buffer
- * @return the size of the stream read or -1 if an error occured
- */
-static int http_read_line(int tcp_sock, char *buf, int size)
+/* A Unix domain socket listening at path, in place of any left behind
+   there; -1 on error */
+int unix_listen(char *path)
 {
-    int offset = 0;
+    struct sockaddr_un addr;
+    int sock;
 
-    do
+    if (strlen(path) >= sizeof(addr.sun_path))
     {
-        if (read(tcp_sock, buf + offset, 1) < 0)
-            return -1;
-        if (buf[offset] != '\r')    /* Strip \r from answer */
-            offset++;
+        fprintf(stderr, "%s: %s\n", path, strerror(ENAMETOOLONG));
+        return -1;
     }
-    while (offset < size - 1 && buf[offset - 1] != '\n');
 
-    buf[offset] = 0;
-    return offset;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+        perror("unix_listen");
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, SOMAXCONN) == -1)
+    {
+        perror(path);
+        close(sock);
+        return -1;
+    }
+
+    return sock;
 }
 
-int http_open(char *arg)
+struct rtp *raw_open(char *arg)
 {
     char *host;
     int port;
-    char *request;
-    int tcp_sock;
-    char http_request[PATH_MAX];
-    char filename[PATH_MAX];
-    char c;
+    int sock;
+    struct rtp *r;
 
     /* Check for URL syntax */
-    if (strncmp(arg, "http://", strlen("http://")))
-        return (0);
+    if (strncmp(arg, "raw://", strlen("raw://")))
+        return (NULL);
 
     /* Parse URL */
-    port = 80;
-    host = arg + strlen("http://");
-    if ((request = strchr(host, '/')) == NULL)
-        return (0);
-    *request++ = 0;
+    port = 0;
+    host = host_port(arg + strlen("raw://"), &port);
 
-    if (strchr(host, ':') != NULL)  /* port is specified */
+    /* Open a UDP socket */
+    if (!(sock = udp_open(host, port)))
     {
-        port = atoi(strchr(host, ':') + 1);
-        *strchr(host, ':') = 0;
+        perror("raw_open");
+        return (NULL);
     }
 
-    /* Open a TCP socket */
-    if (!(tcp_sock = tcp_open(host, port)))
+    if (!(r = calloc(1, sizeof(struct rtp))))
     {
-        perror("http_open");
-        return (0);
+        close(sock);
+        return (NULL);
     }
 
-    snprintf(filename, sizeof(filename) - strlen(host) - 75, "%s", request);
+    r->fd = sock;
+    r->is_rtp = -1;
 
-    /* Send HTTP GET request */
-    /* Please don't use a Agent know by shoutcast (Lynx, Mozilla) seems to be reconized and print
-     * a html page and not the stream */
-    snprintf(http_request, sizeof(http_request), "GET /%s HTTP/1.0\r\n"
-/*  "User-Agent: Mozilla/2.0 (Win95; I)\r\n" */
-             "Pragma: no-cache\r\n" "Host: %s\r\n" "Accept: */*\r\n" "\r\n", filename, host);
+    return (r);
+}
 
-    send(tcp_sock, http_request, strlen(http_request), 0);
+void rtp_close(struct rtp *r)
+{
+    close(r->fd);
+    free(r);
+}
 
-    /* Parse server reply */
-#if 0
-    do
-        read(tcp_sock, &c, sizeof(char));
-    while (c != ' ');
-    read(tcp_sock, http_request, 4 * sizeof(char));
-    http_request[4] = 0;
-    if (strcmp(http_request, "200 "))
-    {
-        fprintf(stderr, "http_open: ");
-        do
-        {
-            read(tcp_sock, &c, sizeof(char));
-            fprintf(stderr, "%c", c);
-        }
-        while (c != '\r');
-        fprintf(stderr, "\n");
-        return (0);
-    }
-#endif
+/* Forget the packets held, for a new source or a jump in sequence
+   numbers, and start again from seq */
+static void rtp_restart(struct rtp *r, unsigned short seq)
+{
+    int i;
 
-    do
+    for (i = 0; i < RTP_SLOTS; i++)
+        r->slots[i].held = 0;
+
+    r->held = 0;
+    r->out = NULL;
+    r->next = r->highest = seq;
+    r->broken = 1;
+}
+
+/* Hold on to the datagram p, which came in at now, till it's its turn */
+static void rtp_hold(struct rtp *r, unsigned char *p, size_t len, long now)
+{
+    struct rtp_slot *slot;
+    unsigned long ssrc = 0;
+    unsigned short seq;
+    size_t start = 0, end = len;
+    int fragment = 0;
+    short ahead;
+    int i;
+
+    if (r->is_rtp == -1)
+        r->is_rtp = (len >= 12 && (p[0] & 0xc0) == 0x80);
+
+    if (r->is_rtp)
     {
-        int len;
+        /* RTP version 2: 12 bytes of header, then any CSRCs, extension
+           header and padding */
+        if (len < 12 || (p[0] & 0xc0) != 0x80)
+            return;
 
-        len = http_read_line(tcp_sock, http_request, sizeof(http_request));
+        seq = (p[2] << 8) | p[3];
+        ssrc = ((unsigned long)p[8] << 24) | (p[9] << 16) | (p[10] << 8) | p[11];
+        start = 12 + 4 * (p[0] & 0x0f);
 
-        if (len == -1)
-        {
-            fprintf(stderr, "http_open: %s\n", strerror(errno));
-            return 0;
-        }
+        if ((p[0] & 0x10) && start + 4 <= len)
+            start += 4 + 4 * ((p[start + 2] << 8) | p[start + 3]);
 
-        if (strncmp(http_request, "Location:", 9) == 0)
-        {
-            /* redirect */
-            close(tcp_sock);
-            
-            http_request[strlen(http_request) - 1] = '\0';
-            
-            return http_open(&http_request[10]);
-        }
+        if (start > len)
+            return;
 
-        if (strncmp(http_request, "ICY ", 4) == 0)
+        /* a pad count that's none, or more than there is, is no packet of
+           ours */
+        if (p[0] & 0x20)
         {
-            /* This is icecast streaming */
-            if (strncmp(http_request + 4, "200 ", 4))
-            {
-                fprintf(stderr, "http_open: %s\n", http_request);
-                return 0;
-            }
+            if (p[len - 1] == 0 || p[len - 1] > len - start)
+                return;
+
+            end -= p[len - 1];
         }
-        else if (strncmp(http_request, "icy-", 4) == 0)
+
+        /* RFC 2250 MPEG audio: 2 bytes that must be 0, then where in a
+           frame the packet starts */
+        if ((p[1] & 0x7f) == 14)
         {
-            /* we can have: icy-noticeX, icy-name, icy-genre, icy-url, icy-pub, icy-metaint, icy-br */
-            /* Don't print these - mpg123 doesn't */
-            /*    fprintf(stderr,"%s\n",http_request); */
+            if (start + 4 > end)
+                return;
+            fragment = ((p[start + 2] << 8) | p[start + 3]) != 0;
+            start += 4;
         }
+
+        if (start > end)
+            return;
     }
-    while (strcmp(http_request, "\n") != 0);
+    else
+        seq = r->started ? r->highest + 1 : 0;
 
-    return (tcp_sock);
-}
+    /* no more than a slot holds */
+    if (end > sizeof(r->slots[0].data))
+        end = sizeof(r->slots[0].data);
 
-int ftp_get_reply(int tcp_sock)
-{
-    int i;
-    char c;
-    char answer[1024];
+    if (start > end)
+        return;
 
-    do
+    if (!r->started || ssrc != r->ssrc)
+    {
+        rtp_restart(r, seq);
+        r->ssrc = ssrc;
+        r->started = 1;
+    }
+
+    ahead = (short)(seq - r->next);
+
+    /* too late: its turn has been and gone */
+    if (ahead < 0)
+    {
+        r->late++;
+        return;
+    }
+
+    /* too far ahead to hold: either that many have been lost, or the
+       sender has jumped */
+    if (ahead >= RTP_SLOTS)
     {
-        /* Read a line */
-        for (i = 0, c = 0; i < 1024 && c != '\n'; i++)
+        for (i = 0; i < RTP_SLOTS; i++)
         {
-            read(tcp_sock, &c, sizeof(char));
-            answer[i] = c;
+            if (!r->slots[i].held)
+                r->lost++;
         }
-        answer[i] = 0;
-        fprintf(stderr, "%s", answer + 4);
+        r->lost += ahead - RTP_SLOTS;
+        rtp_restart(r, seq);
     }
-    while (answer[3] == '-');
 
-    answer[3] = 0;
+    slot = &r->slots[seq % RTP_SLOTS];
+
+    if (slot->held)
+    {
+        r->duplicate++;
+        return;
+    }
 
-    return (atoi(answer));
+    if ((short)(seq - r->highest) < 0)
+        r->reordered++;
+    else
+        r->highest = seq;
+
+    slot->held = 1;
+    slot->seq = seq;
+    slot->arrived = now;
+    slot->start = start;
+    slot->len = end - start;
+    slot->fragment = fragment;
+    memcpy(slot->data, p, end);
+
+    r->held++;
+    r->received++;
 }
 
-int ftp_open(char *arg)
+/* How long in ms till the packet after the gap at r->next has been held
+   long enough that the one missing won't come: 0 if that's now, or -1 if
+   nothing is held */
+int rtp_wait(struct rtp *r)
 {
-    char *host;
-    int port;
-    char *dir;
-    char *file;
-    int tcp_sock;
-    int data_sock;
-    char ftp_request[PATH_MAX];
-    struct sockaddr_in stLclAddr;
-    socklen_t namelen;
+    long oldest = -1;
+    long waited;
     int i;
 
-    /* Check for URL syntax */
-    if (strncmp(arg, "ftp://", strlen("ftp://")))
-        return (0);
+    if (!r->held)
+        return -1;
 
-    /* Parse URL */
-    port = 21;
-    host = arg + strlen("ftp://");
-    if ((dir = strchr(host, '/')) == NULL)
-        return (0);
-    *dir++ = 0;
-    if ((file = strrchr(dir, '/')) == NULL)
-    {
-        file = dir;
-        dir = NULL;
-    }
-    else
-        *file++ = 0;
+    /* keep room for the next batch */
+    if (r->held > RTP_SLOTS - RTP_BATCH)
+        return 0;
 
-    if (strchr(host, ':') != NULL)  /* port is specified */
+    for (i = 0; i < RTP_SLOTS; i++)
     {
-        port = atoi(strchr(host, ':') + 1);
-        *strchr(host, ':') = 0;
+        if (r->slots[i].held && (oldest == -1 || r->slots[i].arrived < oldest))
+            oldest = r->slots[i].arrived;
     }
 
-    /* Open a TCP socket */
-    if (!(tcp_sock = tcp_open(host, port)))
-    {
-        perror("ftp_open");
-        return (0);
-    }
+    waited = now_ms() - oldest;
 
-    /* Send FTP USER and PASS request */
-    ftp_get_reply(tcp_sock);
-    sprintf(ftp_request, "USER anonymous\r\n");
-    send(tcp_sock, ftp_request, strlen(ftp_request), 0);
-    if (ftp_get_reply(tcp_sock) != 331)
-        return (0);
-    sprintf(ftp_request, "PASS smpeguser@\r\n");
-    send(tcp_sock, ftp_request, strlen(ftp_request), 0);
-    if (ftp_get_reply(tcp_sock) != 230)
-        return (0);
-    sprintf(ftp_request, "TYPE I\r\n");
-    send(tcp_sock, ftp_request, strlen(ftp_request), 0);
-    if (ftp_get_reply(tcp_sock) != 200)
-        return (0);
-    if (dir != NULL)
+    return (waited >= options.jitter) ? 0 : options.jitter - waited;
+}
+
+/* Set up r->out with what comes next: the packet at r->next, or, if it
+   has been waited on long enough, a repeat of the last for it. Returns 0
+   if there's nothing yet. */
+static int rtp_next(struct rtp *r)
+{
+    struct rtp_slot *s;
+    unsigned char *p;
+
+    while (r->held)
     {
-        snprintf(ftp_request, sizeof(ftp_request), "CWD %s\r\n", dir);
-        send(tcp_sock, ftp_request, strlen(ftp_request), 0);
-        if (ftp_get_reply(tcp_sock) != 250)
-            return (0);
-    }
+        s = &r->slots[r->next % RTP_SLOTS];
 
-    /* Get interface address */
-    namelen = sizeof(stLclAddr);
-    if (getsockname(tcp_sock, (struct sockaddr *)&stLclAddr, &namelen) < 0)
-        return (0);
+        if (s->held)
+        {
+            /* the rest of a frame whose start was lost is no use to
+               libmad */
+            if (s->len == 0 || (s->fragment && r->broken))
+            {
+                s->held = 0;
+                r->held--;
+                r->next++;
+                continue;
+            }
 
-    /* Open data socket */
-    if ((data_sock = socket(PF_INET, SOCK_STREAM, 0)) < 0)
-        return (0);
+            r->broken = 0;
+            p = s->data + s->start;
 
-    stLclAddr.sin_family = AF_INET;
+            if (!s->fragment && s->len >= 2 && p[0] == 0xff && (p[1] & 0xe0) == 0xe0)
+            {
+                memcpy(r->last, p, s->len);
+                r->last_len = s->len;
+            }
 
-    /* Get the first free port */
-    for (i = 0; i < 0xC000; i++)
-    {
-        stLclAddr.sin_port = htons(0x4000 + i);
-        if (bind(data_sock, (struct sockaddr *)&stLclAddr, sizeof(stLclAddr)) >= 0)
-            break;
-    }
-    port = 0x4000 + i;
+            r->out = p;
+            r->out_len = s->len;
+            r->out_pos = 0;
+            r->concealing = 0;
+            return 1;
+        }
 
-    if (listen(data_sock, 1) < 0)
-        return (0);
+        if (rtp_wait(r) != 0)
+            return 0;
 
-    i = ntohl(stLclAddr.sin_addr.s_addr);
-    sprintf(ftp_request, "PORT %d,%d,%d,%d,%d,%d\r\n",
-            (i >> 24) & 0xFF, (i >> 16) & 0xFF,
-            (i >> 8) & 0xFF, i & 0xFF, (port >> 8) & 0xFF, port & 0xFF);
-    send(tcp_sock, ftp_request, strlen(ftp_request), 0);
-    if (ftp_get_reply(tcp_sock) != 200)
-        return (0);
+        /* given up on: play the last frame again in its place, which is
+           less jarring than a gap */
+        r->lost++;
+        r->broken = 1;
 
-    snprintf(ftp_request, sizeof(ftp_request), "RETR %s\r\n", file);
-    send(tcp_sock, ftp_request, strlen(ftp_request), 0);
-    if (ftp_get_reply(tcp_sock) != 150)
-        return (0);
+        if (r->last_len)
+        {
+            r->out = r->last;
+            r->out_len = r->last_len;
+            r->out_pos = 0;
+            r->concealing = 1;
+            r->concealed++;
+            return 1;
+        }
+
+        r->next++;
+    }
+
+    return 0;
+}
+
+/* Pass on up to room bytes of MPEG audio from the packets held, in
+   order. Returns how much. */
+size_t rtp_take(struct rtp *r, unsigned char *dst, size_t room)
+{
+    size_t done = 0;
+    size_t n;
+
+    while (done < room && (r->out || rtp_next(r)))
+    {
+        n = r->out_len - r->out_pos;
+        if (n > room - done)
+            n = room - done;
+
+        memcpy(dst + done, r->out + r->out_pos, n);
+        done += n;
+        r->out_pos += n;
+
+        if (r->out_pos == r->out_len)
+        {
+            if (!r->concealing)
+            {
+                r->slots[r->next % RTP_SLOTS].held = 0;
+                r->held--;
+            }
+            r->next++;
+            r->out = NULL;
+        }
+    }
+
+    return done;
+}
+
+/* Take the datagrams waiting on r's socket into the jitter buffer, as
+   many at a time as there's room for. Returns how many, or -1. */
+int rtp_recv(struct rtp *r)
+{
+#ifdef HAVE_RECVMMSG
+    struct mmsghdr msgs[RTP_BATCH];
+    struct iovec iov[RTP_BATCH];
+    int i;
+#else
+    ssize_t got;
+#endif
+    long now;
+    int want;
+    int n;
+
+    want = RTP_SLOTS - r->held;
+    if (want > RTP_BATCH)
+        want = RTP_BATCH;
+
+#ifdef HAVE_RECVMMSG
+    memset(msgs, 0, sizeof(msgs));
+
+    for (i = 0; i < want; i++)
+    {
+        iov[i].iov_base = r->batch[i];
+        iov[i].iov_len = RTP_PACKET;
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    if ((n = recvmmsg(r->fd, msgs, want, MSG_DONTWAIT, NULL)) < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+
+    now = now_ms();
+
+    for (i = 0; i < n; i++)
+    {
+        if (!(msgs[i].msg_hdr.msg_flags & MSG_TRUNC))
+            rtp_hold(r, r->batch[i], msgs[i].msg_len, now);
+    }
+#else
+    for (n = 0; n < want; n++)
+    {
+        if ((got = recv(r->fd, r->batch[0], RTP_PACKET, MSG_DONTWAIT | MSG_TRUNC)) < 0)
+        {
+            if (n || errno == EAGAIN || errno == EINTR)
+                break;
+            return -1;
+        }
+
+        now = now_ms();
+
+        if (got <= RTP_PACKET)
+            rtp_hold(r, r->batch[0], got, now);
+    }
+#endif
+
+    return n;
+}
+
+/* Loss and reordering so far, for the user. Returns 0 if the stream
+   isn't RTP, and there's nothing to say. */
+int rtp_stats(struct rtp *r, char *buf, size_t size)
+{
+    if (r->is_rtp != 1)
+        return 0;
+
+    snprintf(buf, size, "%lu received, %lu lost, %lu reordered, %lu late, %lu duplicate, %lu concealed",
+             r->received, r->lost, r->reordered, r->late, r->duplicate, r->concealed);
+
+    return 1;
+}
+
+/* How many idle keep-alive connections to keep */
+#define HTTP_POOL_SIZE 4
+
+/* Most to read at a time while looking for a chunk size */
+#define HTTP_FRAMING_READ 32
+
+/* How many times to try to pick up a dropped download where it left off,
+   without getting anything in between */
+#define HTTP_RETRIES 3
+
+/* How many redirects to follow for a URL before giving up on it */
+#define HTTP_REDIRECTS 5
+
+/* What http_want() has asked to be read */
+enum
+{
+    HTTP_TARGET_NONE,   /* nothing: there's data in h->buf to pass on */
+    HTTP_TARGET_DST,    /* audio, straight to where it's wanted */
+    HTTP_TARGET_BUF     /* a chunk size, into h->buf */
+};
+
+/* Idle keep-alive connections, for the next file on the same server */
+static struct http *http_pool[HTTP_POOL_SIZE];
+
+static void http_drop(struct http *h)
+{
+    close(h->fd);
+    free(h);
+}
+
+/* A connection to host:port: one left idle in the pool if there is one
+   that's still open, or else a new one */
+static struct http *http_connect(char *host, int port)
+{
+    struct http *h;
+    char c;
+    int i;
+
+    for (i = 0; i < HTTP_POOL_SIZE; i++)
+    {
+        if (!(h = http_pool[i]) || h->port != port || strcmp(h->host, host))
+            continue;
+
+        http_pool[i] = NULL;
+
+        /* the server may have closed it since */
+        if (recv(h->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN)
+        {
+            h->reused = 1;
+            return h;
+        }
+
+        http_drop(h);
+    }
+
+    if (!(h = calloc(1, sizeof(struct http))))
+        return NULL;
+
+    if (!(h->fd = tcp_open(host, port)))
+    {
+        free(h);
+        return NULL;
+    }
+
+    snprintf(h->host, sizeof(h->host), "%s", host);
+    h->port = port;
+
+    return h;
+}
+
+/* Done with h: back to the pool if the whole response has been read and
+   the server will take another request on it, or else close it */
+void http_close(struct http *h)
+{
+    int i;
+
+    if (h->ended && h->keepalive && h->pos == h->len)
+    {
+        h->reused = 0;
+
+        for (i = 0; i < HTTP_POOL_SIZE; i++)
+        {
+            if (!http_pool[i])
+            {
+                http_pool[i] = h;
+                return;
+            }
+        }
+
+        /* pool's full: make room by dropping the first */
+        http_drop(http_pool[0]);
+        memmove(http_pool, http_pool + 1, (HTTP_POOL_SIZE - 1) * sizeof(struct http *));
+        http_pool[HTTP_POOL_SIZE - 1] = h;
+        return;
+    }
+
+    http_drop(h);
+}
+
+/* Read what's there, up to max bytes, after the unused part of h->buf.
+   Returns what read() did. */
+static ssize_t http_fill(struct http *h, size_t max)
+{
+    ssize_t n;
+
+    if (h->pos)
+    {
+        memmove(h->buf, h->buf + h->pos, h->len - h->pos);
+        h->len -= h->pos;
+        h->pos = 0;
+    }
+
+    if (max > sizeof(h->buf) - h->len)
+        max = sizeof(h->buf) - h->len;
+
+    if (max == 0)
+    {
+        errno = E2BIG;
+        return -1;
+    }
+
+    do
+        n = read(h->fd, h->buf + h->len, max);
+    while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+        h->len += n;
+
+    return n;
+}
+
+/**
+ * Read a http line header.
+ * This function reads from the connection a block at a time, and keeps
+ * what follows the line for next time.
+ * @param h the connection to read the header from
+ * @param buf a buffer to receive the line, without its line ending
+ * @param size size of the buffer
+ * @return the length of the line or -1 if an error occured
+ */
+static int http_read_line(struct http *h, char *buf, int size)
+{
+    unsigned char *nl;
+    int offset = 0;
+    ssize_t n;
+
+    while (!(nl = memchr(h->buf + h->pos, '\n', h->len - h->pos)))
+    {
+        if ((n = http_fill(h, sizeof(h->buf))) <= 0)
+        {
+            if (n == 0)
+                errno = ECONNRESET;
+            return -1;
+        }
+    }
+
+    for (; h->buf + h->pos < nl; h->pos++)
+    {
+        if (h->buf[h->pos] != '\r' && offset < size - 1)    /* Strip \r from answer */
+            buf[offset++] = h->buf[h->pos];
+    }
+
+    h->pos++;
+    buf[offset] = 0;
+    return offset;
+}
+
+/* Take what we can of an ICY metadata block from the n bytes at p: its
+   length byte, or what's left of it. Returns how many bytes were used. */
+static size_t http_icy(struct http *h, unsigned char *p, size_t n)
+{
+    if (h->meta_left < 0)
+    {
+        h->meta_left = *p * 16;
+        h->meta_len = 0;
+        n = 1;
+    }
+    else
+    {
+        if (n > (size_t)h->meta_left)
+            n = h->meta_left;
+
+        memcpy(h->meta + h->meta_len, p, n);
+        h->meta_len += n;
+        h->meta_left -= n;
+    }
+
+    if (h->meta_left == 0)
+    {
+        /* it's padded out with NULs; an empty one means no change */
+        h->meta[h->meta_len] = 0;
+
+        if (h->meta[0] && strcmp(h->meta, h->icy))
+        {
+            strcpy(h->icy, h->meta);
+            h->icy_changed = 1;
+        }
+
+        h->meta_left = -1;
+        h->audio_left = h->metaint;
+    }
+
+    return n;
+}
+
+/* Try to make sense of buffered bytes of the body: pass on what's audio
+   to h->dst, and read chunk sizes and ICY metadata. Returns the number of
+   bytes passed on. */
+static ssize_t http_drain(struct http *h)
+{
+    size_t got = 0, n;
+    unsigned char *nl;
+    char *end;
+
+    while (h->pos < h->len && !h->ended)
+    {
+        if (h->left != 0)
+        {
+            n = h->len - h->pos;
+            if (h->left > 0 && (off_t)n > h->left)
+                n = h->left;
+
+            if (h->metaint && h->audio_left == 0)
+                n = http_icy(h, h->buf + h->pos, n);
+
+            else
+            {
+                if (n > h->room - got)
+                    n = h->room - got;
+                if (h->metaint && n > h->audio_left)
+                    n = h->audio_left;
+
+                if (n == 0)
+                    break;
+
+                memcpy(h->dst + got, h->buf + h->pos, n);
+                got += n;
+
+                if (h->metaint)
+                    h->audio_left -= n;
+            }
+
+            h->pos += n;
+            h->offset += n;
+
+            if (h->left > 0 && (h->left -= n) == 0 && !h->chunked)
+                h->ended = 1;
+
+            continue;
+        }
+
+        /* the size line of the next chunk, after the CRLF ending the last
+           one; or after the last chunk, trailers up to an empty line */
+        if (!(nl = memchr(h->buf + h->pos, '\n', h->len - h->pos)))
+            break;
+
+        if (h->last_chunk)
+        {
+            if (h->buf[h->pos] == '\r' || h->buf[h->pos] == '\n')
+                h->ended = 1;
+        }
+        else if (nl > h->buf + h->pos + 1 || h->buf[h->pos] != '\r')
+        {
+            *nl = 0;
+            h->left = strtol((char *)h->buf + h->pos, &end, 16);
+
+            if (end == (char *)h->buf + h->pos || h->left < 0)
+            {
+                /* not a chunk size: give up on the connection */
+                h->keepalive = 0;
+                h->ended = 1;
+            }
+            else if (h->left == 0)
+                h->last_chunk = 1;
+        }
+
+        h->pos = nl + 1 - h->buf;
+    }
+
+    return got;
+}
+
+/* Where the next read on h->fd should go, to put at most room more bytes of
+   the body at dst. Audio is read straight into dst. Chunk sizes are read
+   into h->buf a little at a time, so few audio bytes have to be copied
+   out after them, and ICY metadata a block at a time. If there's
+   something in h->buf to pass on first, the read is of nothing. Returns 0
+   when the body is over. */
+int http_want(struct http *h, unsigned char *dst, size_t room, struct iovec *iov)
+{
+    int meta;
+
+    h->dst = dst;
+    h->room = room;
+
+    if (h->ended)
+        return 0;
+
+    iov->iov_len = 0;
+    h->target = HTTP_TARGET_NONE;
+
+    if (h->pos < h->len && (h->left != 0
+            || memchr(h->buf + h->pos, '\n', h->len - h->pos)))
+        return 1;
+
+    meta = (h->metaint && h->audio_left == 0);
+
+    if (h->left != 0 && !meta)
+    {
+        h->target = HTTP_TARGET_DST;
+        iov->iov_base = dst;
+        iov->iov_len = room;
+
+        if (h->left > 0 && h->left < (off_t)room)
+            iov->iov_len = h->left;
+        if (h->metaint && h->audio_left < iov->iov_len)
+            iov->iov_len = h->audio_left;
+    }
+    else
+    {
+        if (h->pos)
+        {
+            memmove(h->buf, h->buf + h->pos, h->len - h->pos);
+            h->len -= h->pos;
+            h->pos = 0;
+        }
+
+        h->target = HTTP_TARGET_BUF;
+        iov->iov_base = h->buf + h->len;
+        iov->iov_len = sizeof(h->buf) - h->len;
+
+        if (h->left == 0)
+        {
+            if (iov->iov_len > HTTP_FRAMING_READ)
+                iov->iov_len = HTTP_FRAMING_READ;
+        }
+        else
+        {
+            /* no further than the end of the metadata, so the audio after
+               it can go straight to dst */
+            if (iov->iov_len > (size_t)(h->meta_left < 0 ? 1 : h->meta_left))
+                iov->iov_len = (h->meta_left < 0 ? 1 : h->meta_left);
+            if (h->left > 0 && h->left < (off_t)iov->iov_len)
+                iov->iov_len = h->left;
+        }
+    }
+
+    return 1;
+}
+
+/* The read http_want() asked for came back with got bytes, or -errno.
+   Returns the number of body bytes now at dst, or -1 when the body is
+   over. */
+ssize_t http_got(struct http *h, ssize_t got)
+{
+    int target = h->target;
+    ssize_t n = 0;
+
+    h->target = HTTP_TARGET_NONE;
+
+    if (target == HTTP_TARGET_DST)
+    {
+        if (got > 0)
+        {
+            n = got;
+            h->offset += got;
+
+            if (h->metaint)
+                h->audio_left -= got;
+
+            if (h->left > 0 && (h->left -= got) == 0 && !h->chunked)
+                h->ended = 1;
+        }
+    }
+    else
+    {
+        if (target == HTTP_TARGET_BUF && got > 0)
+            h->len += got;
+
+        n = http_drain(h);
+    }
+
+    /* the server closed the connection, which is how a body of unknown
+       length ends; anywhere else it's an error, and http_resume() can
+       try to carry on */
+    if (target != HTTP_TARGET_NONE && got <= 0 && got != -EINTR && got != -EAGAIN
+        && !h->ended)
+    {
+        h->truncated = (h->left > 0 || h->chunked);
+        h->keepalive = 0;
+        h->ended = 1;
+    }
+
+    if (n > 0)
+        h->retries = 0;
+
+    return (n == 0 && h->ended) ? -1 : n;
+}
+
+/* A pooled connection may have been closed by the server meanwhile:
+   that's to be -1 here, not a SIGPIPE */
+static int send_all(int sock, char *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        if ((n = send(sock, buf, len, MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/* in, base64 encoded into out */
+static void base64(char const *in, char *out, size_t size)
+{
+    static char const digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t len = strlen(in), i, o = 0;
+    unsigned long bits;
+
+    for (i = 0; i < len && o + 5 <= size; i += 3)
+    {
+        bits = (unsigned char)in[i] << 16;
+        if (i + 1 < len)
+            bits |= (unsigned char)in[i + 1] << 8;
+        if (i + 2 < len)
+            bits |= (unsigned char)in[i + 2];
+
+        out[o++] = digits[(bits >> 18) & 63];
+        out[o++] = digits[(bits >> 12) & 63];
+        out[o++] = (i + 1 < len) ? digits[(bits >> 6) & 63] : '=';
+        out[o++] = (i + 2 < len) ? digits[bits & 63] : '=';
+    }
+
+    out[o] = 0;
+}
+
+/* The proxy to send requests through, from --proxy or else $http_proxy,
+   as [http://][user:password@]host[:port][/]: its host and port, and the
+   Proxy-Authorization header for it, or "". Returns 0 if there isn't
+   one. */
+static int http_proxy(char *host, size_t size, int *port, char *auth, size_t auth_size)
+{
+    char buf[512], *proxy, *p, *at;
+    char creds[384];
+
+    if (!(proxy = options.proxy ? options.proxy : getenv("http_proxy")) || !*proxy)
+        return 0;
+
+    if (strncmp(proxy, "http://", strlen("http://")) == 0)
+        proxy += strlen("http://");
+
+    snprintf(buf, sizeof(buf), "%s", proxy);
+    if ((p = strchr(buf, '/')))
+        *p = 0;
+
+    auth[0] = 0;
+    p = buf;
+
+    if ((at = strrchr(buf, '@')))
+    {
+        *at = 0;
+        p = at + 1;
+
+        base64(buf, creds, sizeof(creds));
+        snprintf(auth, auth_size, "Proxy-Authorization: Basic %s\r\n", creds);
+    }
+
+    *port = 80;
+    snprintf(host, size, "%s", host_port(p, port));
+
+    return 1;
+}
+
+static struct http *http_url(char *arg, int hops);
+
+/* Ask host:port for path, from byte from of it on if that's not 0, and
+   read the headers of the reply; hops is how many redirects it took to
+   get here */
+static struct http *http_get(char *host, int port, char *path, off_t from, int hops)
+{
+    struct http *h;
+    char http_request[PATH_MAX + 1024];
+    char hostport[300];
+    char proxy[256];
+    char auth[560];
+    int proxy_port;
+    int proxied;
+    char range[64];
+    char location[PATH_MAX];
+    int status = 0, minor = 0;
+    off_t length = -1;
+    long long first;
+    char *slash;
+    int reused;
+
+    /* IPv6 addresses go in brackets */
+    if (strchr(host, ':'))
+        snprintf(hostport, sizeof(hostport), "[%s]", host);
+    else
+        snprintf(hostport, sizeof(hostport), "%s", host);
+
+    if (port != 80)
+        snprintf(hostport + strlen(hostport), sizeof(hostport) - strlen(hostport), ":%d", port);
+
+    range[0] = 0;
+    if (from > 0)
+        snprintf(range, sizeof(range), "Range: bytes=%lld-\r\n", (long long)from);
+
+    /* Send HTTP GET request */
+    /* Please don't use a Agent know by shoutcast (Lynx, Mozilla) seems to be reconized and print
+     * a html page and not the stream */
+    /* Through a proxy, the request is for the whole URL, and is left for
+     * it to answer from its cache if it can */
+    proxied = http_proxy(proxy, sizeof(proxy), &proxy_port, auth, sizeof(auth));
+
+    if (proxied)
+        snprintf(http_request, sizeof(http_request), "GET http://%s/%s HTTP/1.1\r\n"
+                 "Host: %s\r\n" "%s" "Accept: */*\r\n" "Icy-MetaData: 1\r\n" "%s" "\r\n",
+                 hostport, path, hostport, auth, range);
+    else
+        snprintf(http_request, sizeof(http_request), "GET /%s HTTP/1.1\r\n"
+/*  "User-Agent: Mozilla/2.0 (Win95; I)\r\n" */
+                 "Pragma: no-cache\r\n" "Host: %s\r\n" "Accept: */*\r\n" "Icy-MetaData: 1\r\n" "%s" "\r\n",
+                 path, hostport, range);
+
+    while (1)
+    {
+        /* Open a TCP socket, or reuse one; to the proxy, the same one
+           for every file */
+        if (!(h = proxied ? http_connect(proxy, proxy_port) : http_connect(host, port)))
+        {
+            perror("http_open");
+            return (NULL);
+        }
+
+        reused = h->reused;
+
+        h->chunked = h->last_chunk = h->ended = h->keepalive = 0;
+        h->ranges = h->truncated = h->retries = 0;
+        h->left = h->start = h->offset = 0;
+        h->size = -1;
+        h->metaint = 0;
+        h->meta_left = -1;
+        h->icy[0] = 0;
+        h->icy_changed = 0;
+        snprintf(h->server, sizeof(h->server), "%s", host);
+        h->server_port = port;
+        snprintf(h->path, sizeof(h->path), "%s", path);
+
+        if (send_all(h->fd, http_request, strlen(http_request)) == 0
+            && http_read_line(h, location, sizeof(location)) > 0)
+            break;
+
+        /* a kept-alive connection can be closed by the server at any time;
+           try again on a new one */
+        http_drop(h);
+
+        if (!reused)
+        {
+            fprintf(stderr, "http_open: %s\n", strerror(errno));
+            return (NULL);
+        }
+    }
+
+    /* Parse server reply */
+    if (strncmp(location, "ICY ", 4) == 0)
+    {
+        /* This is icecast streaming */
+        if (strncmp(location + 4, "200 ", 4))
+        {
+            fprintf(stderr, "http_open: %s\n", location);
+            http_drop(h);
+            return (NULL);
+        }
+    }
+    else if (sscanf(location, "HTTP/1.%d %d", &minor, &status) == 2)
+    {
+        if (status < 200 || status >= 400)
+        {
+            fprintf(stderr, "http_open: %s\n", location);
+            http_drop(h);
+            return (NULL);
+        }
+
+        /* HTTP/1.1 keeps the connection open unless told otherwise */
+        h->keepalive = (minor >= 1);
+    }
+
+    location[0] = 0;
+
+    do
+    {
+        int len;
+
+        len = http_read_line(h, http_request, sizeof(http_request));
+
+        if (len == -1)
+        {
+            fprintf(stderr, "http_open: %s\n", strerror(errno));
+            http_drop(h);
+            return (NULL);
+        }
+
+        if (strncasecmp(http_request, "Location:", 9) == 0)
+        {
+            snprintf(location, sizeof(location), "%s", http_request + 9 + strspn(http_request + 9, " \t"));
+        }
+        else if (strncasecmp(http_request, "Content-Length:", 15) == 0)
+        {
+            length = strtoll(http_request + 15, NULL, 10);
+        }
+        else if (strncasecmp(http_request, "Accept-Ranges:", 14) == 0)
+        {
+            if (strstr(http_request + 14, "bytes"))
+                h->ranges = 1;
+        }
+        else if (strncasecmp(http_request, "Content-Range:", 14) == 0)
+        {
+            /* bytes first-last/size, size being * if the server doesn't
+               know it */
+            if (status == 206 && sscanf(http_request + 14, " bytes %lld-", &first) == 1)
+            {
+                h->ranges = 1;
+                h->start = first;
+                if ((slash = strchr(http_request, '/')) && slash[1] != '*')
+                    h->size = strtoll(slash + 1, NULL, 10);
+            }
+        }
+        else if (strncasecmp(http_request, "Transfer-Encoding:", 18) == 0)
+        {
+            if (strstr(http_request + 18, "chunked"))
+                h->chunked = 1;
+        }
+        else if (strncasecmp(http_request, "Connection:", 11) == 0)
+        {
+            if (strstr(http_request + 11, "close"))
+                h->keepalive = 0;
+            else if (strstr(http_request + 11, "eep-alive"))
+                h->keepalive = 1;
+        }
+        else if (strncasecmp(http_request, "icy-metaint:", 12) == 0)
+        {
+            /* there'll be metadata in among the audio, which we asked for
+               with Icy-MetaData */
+            h->metaint = strtoul(http_request + 12, NULL, 10);
+        }
+        else if (strncasecmp(http_request, "icy-", 4) == 0)
+        {
+            /* we can have: icy-noticeX, icy-name, icy-genre, icy-url, icy-pub, icy-br */
+            /* Don't print these - mpg123 doesn't */
+            /*    fprintf(stderr,"%s\n",http_request); */
+        }
+    }
+    while (http_request[0] != 0);
+
+    /* How the body ends: after the last chunk, after Content-Length bytes,
+       or when the server closes the connection */
+    if (h->chunked)
+        h->left = 0;
+    else if (length >= 0)
+    {
+        h->left = length;
+        h->ended = (length == 0);
+    }
+    else
+    {
+        h->left = -1;
+        h->keepalive = 0;
+    }
+
+    /* a whole file of Content-Length bytes */
+    if (status == 200 && length >= 0 && !h->chunked)
+        h->size = length;
+
+    h->offset = h->start;
+    h->audio_left = h->metaint;
+
+    if (location[0] && status >= 300)
+    {
+        /* redirect; the connection can be used again if the reply had an
+           empty body, as it usually has */
+        http_close(h);
+
+        if (hops == HTTP_REDIRECTS)
+        {
+            fprintf(stderr, "http_open: too many redirects\n");
+            return NULL;
+        }
+
+        return http_url(location, hops + 1);
+    }
+
+    return (h);
+}
+
+static struct http *http_url(char *arg, int hops)
+{
+    char *host;
+    int port;
+    char *request;
+
+    /* Check for URL syntax */
+    if (strncmp(arg, "http://", strlen("http://")))
+        return (NULL);
+
+    /* Parse URL */
+    port = 80;
+    host = arg + strlen("http://");
+    if ((request = strchr(host, '/')) == NULL)
+        return (NULL);
+    *request++ = 0;
+
+    host = host_port(host, &port);
+
+    return http_get(host, port, request, 0, hops);
+}
+
+struct http *http_open(char *arg)
+{
+    return http_url(arg, 0);
+}
+
+/* Carry on with the file h is downloading from byte pos of it, over
+   another request; h stays as it was if the server won't do that */
+int http_reopen(struct http *h, off_t pos)
+{
+    struct http *n;
+    int retries = h->retries;
+
+    /* there's no knowing where the metadata falls from anywhere but the
+       start */
+    if (!h->ranges || h->metaint || (h->size >= 0 && pos >= h->size))
+        return -1;
+
+    if (!(n = http_get(h->server, h->server_port, h->path, pos, 0)))
+        return -1;
+
+    /* the server may have sent the whole file after all, or been
+       redirected somewhere that doesn't do ranges */
+    if (n->start != pos)
+    {
+        http_drop(n);
+        return -1;
+    }
+
+    /* the old connection is in the middle of a response, so it's no use
+       to anyone */
+    close(h->fd);
+    *h = *n;
+    h->retries = retries;
+    free(n);
+
+    return 0;
+}
+
+/* The connection dropped in the middle of the body: pick up where it left
+   off on a new one, if the server lets us */
+int http_resume(struct http *h)
+{
+    if (h->retries >= HTTP_RETRIES)
+        return -1;
+
+    h->retries++;
+
+    return http_reopen(h, h->offset);
+}
+
+/* How many logged-in control connections to keep between files */
+#define FTP_POOL_SIZE 2
+
+/* How many times to try to pick up a dropped transfer where it left off,
+   without getting anything in between */
+#define FTP_RETRIES 3
+
+/* How long in ms to wait for the second reply to ABOR, which servers
+   don't all send */
+#define FTP_ABORT_WAIT 200
+
+/* Idle control connections, for the next file on the same server */
+static struct ftp *ftp_pool[FTP_POOL_SIZE];
+
+static void ftp_drop(struct ftp *f)
+{
+    if (f->data != -1)
+        close(f->data);
+    close(f->fd);
+    free(f);
+}
+
+/* Wait up to ms for the server to say something: 1 if it has */
+static int ftp_ready(struct ftp *f, int ms)
+{
+    struct pollfd p;
+
+    if (f->pos < f->len)
+        return 1;
+
+    p.fd = f->fd;
+    p.events = POLLIN;
+
+    return poll(&p, 1, ms) > 0;
+}
+
+/* Read a reply from the server, through f->buf so as not to go a byte at
+   a time. Returns its code, with the last line of it in f->reply, or -1. */
+static int ftp_reply(struct ftp *f)
+{
+    unsigned char *nl;
+    char code[4];
+    size_t n;
+    ssize_t got;
+
+    code[0] = 0;
+
+    while (1)
+    {
+        while (!(nl = memchr(f->buf + f->pos, '\n', f->len - f->pos)))
+        {
+            memmove(f->buf, f->buf + f->pos, f->len - f->pos);
+            f->len -= f->pos;
+            f->pos = 0;
+
+            /* a line too long to keep: only its end matters */
+            if (f->len == sizeof(f->buf))
+                f->len = 0;
+
+            if (!ftp_ready(f, options.connect_timeout))
+            {
+                errno = ETIMEDOUT;
+                return -1;
+            }
+
+            if ((got = read(f->fd, f->buf + f->len, sizeof(f->buf) - f->len)) <= 0)
+            {
+                if (got < 0 && errno == EINTR)
+                    continue;
+                if (got == 0)
+                    errno = ECONNRESET;
+                return -1;
+            }
+            f->len += got;
+        }
+
+        n = nl - (f->buf + f->pos);
+        if (n > 0 && nl[-1] == '\r')
+            n--;
+        if (n >= sizeof(f->reply))
+            n = sizeof(f->reply) - 1;
+        memcpy(f->reply, f->buf + f->pos, n);
+        f->reply[n] = 0;
+        f->pos = nl + 1 - f->buf;
+
+        if (!code[0])
+        {
+            if (n < 3)
+                return -1;
+            memcpy(code, f->reply, 3);
+            code[3] = 0;
+        }
+
+        /* a multi-line reply ends with its code and a space */
+        if (strncmp(f->reply, code, 3) == 0 && f->reply[3] != '-')
+            return atoi(code);
+    }
+}
+
+/* Send a command, and return the code of the reply to it */
+static int ftp_command(struct ftp *f, char const *fmt, ...)
+{
+    char cmd[PATH_MAX + 16];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(cmd, sizeof(cmd) - 2, fmt, ap);
+    va_end(ap);
+
+    if (len < 0 || len >= (int)sizeof(cmd) - 2)
+        return -1;
+    strcpy(cmd + len, "\r\n");
+
+    if (send_all(f->fd, cmd, len + 2) < 0)
+        return -1;
+
+    return ftp_reply(f);
+}
+
+/* Connect to host:port and log in */
+static struct ftp *ftp_login(char *host, int port, char *user, char *pass)
+{
+    struct ftp *f;
+    int code;
+
+    if (!(f = calloc(1, sizeof(struct ftp))))
+        return NULL;
+
+    f->data = -1;
+    if (!(f->fd = tcp_open(host, port)))
+    {
+        perror("ftp_open");
+        free(f);
+        return NULL;
+    }
+
+    snprintf(f->host, sizeof(f->host), "%s", host);
+    f->port = port;
+    snprintf(f->user, sizeof(f->user), "%s", user);
+    snprintf(f->pass, sizeof(f->pass), "%s", pass);
+
+    if ((code = ftp_reply(f)) == 220
+        && ((code = ftp_command(f, "USER %s", user)) == 230
+            || (code == 331 && (code = ftp_command(f, "PASS %s", pass)) == 230))
+        && (code = ftp_command(f, "TYPE I")) == 200)
+        return f;
+
+    if (code < 0)
+        perror("ftp_open");
+    else
+        fprintf(stderr, "ftp_open: %s\n", f->reply);
+    ftp_drop(f);
+
+    return NULL;
+}
+
+/* A control connection to host:port, logged in as user: one left idle in
+   the pool if there is one that's still open, or else a new one */
+static struct ftp *ftp_connect(char *host, int port, char *user, char *pass)
+{
+    struct ftp *f;
+    char c;
+    int i;
+
+    for (i = 0; i < FTP_POOL_SIZE; i++)
+    {
+        if (!(f = ftp_pool[i]) || f->port != port || strcmp(f->host, host)
+            || strcmp(f->user, user) || strcmp(f->pass, pass))
+            continue;
+
+        ftp_pool[i] = NULL;
+
+        /* the server may have timed it out since */
+        if (recv(f->fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && errno == EAGAIN)
+        {
+            f->reused = 1;
+            return f;
+        }
+
+        ftp_drop(f);
+    }
+
+    return ftp_login(host, port, user, pass);
+}
+
+/* Open a passive data connection, with EPSV or else PASV. Either way it
+   goes to the address the control connection is to, as a server behind
+   NAT may well give its private one. Returns the socket, or -1. */
+static int ftp_passive(struct ftp *f)
+{
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+    char host[INET6_ADDRSTRLEN];
+    char *p;
+    int a[6];
+    int port = -1;
+    int sock;
+
+    if (getpeername(f->fd, (struct sockaddr *)&peer, &len) < 0
+        || getnameinfo((struct sockaddr *)&peer, len, host, sizeof(host), NULL, 0, NI_NUMERICHOST))
+        return -1;
+
+    /* 229 Entering Extended Passive Mode (|||port|) */
+    if (!f->no_epsv)
+    {
+        if (ftp_command(f, "EPSV") == 229 && (p = strchr(f->reply, '('))
+            && sscanf(p, "(%*c%*c%*c%d", &port) == 1)
+            ;
+        else
+            f->no_epsv = 1;
+    }
+
+    /* 227 Entering Passive Mode (h1,h2,h3,h4,p1,p2), with or without the
+       brackets */
+    if (port <= 0 && !f->no_pasv)
+    {
+        if (ftp_command(f, "PASV") == 227)
+        {
+            for (p = f->reply + 3; *p && (*p < '0' || *p > '9'); p++)
+                ;
+            if (sscanf(p, "%d,%d,%d,%d,%d,%d", &a[0], &a[1], &a[2], &a[3], &a[4], &a[5]) == 6)
+                port = a[4] * 256 + a[5];
+        }
+        else
+            f->no_pasv = 1;
+    }
+
+    if (port <= 0 || port > 65535)
+        return -1;
+
+    if (!(sock = tcp_open(host, port)))
+        return -1;
+
+    return sock;
+}
+
+/* For servers that won't do passive: listen on the address the control
+   connection is from, and tell the server to connect there with PORT or
+   EPRT. Returns the listening socket, or -1. */
+static int ftp_active(struct ftp *f)
+{
+    struct sockaddr_storage local;
+    socklen_t len = sizeof(local);
+    char host[INET6_ADDRSTRLEN];
+    unsigned char *a;
+    int sock;
+    int port;
+    int code;
+
+    if (getsockname(f->fd, (struct sockaddr *)&local, &len) < 0)
+        return -1;
+
+    if (local.ss_family == AF_INET)
+        ((struct sockaddr_in *)&local)->sin_port = 0;
+    else
+        ((struct sockaddr_in6 *)&local)->sin6_port = 0;
+
+    if ((sock = socket(local.ss_family, SOCK_STREAM, 0)) < 0)
+        return -1;
+
+    if (bind(sock, (struct sockaddr *)&local, len) < 0 || listen(sock, 1) < 0
+        || getsockname(sock, (struct sockaddr *)&local, &len) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+
+    if (local.ss_family == AF_INET)
+    {
+        a = (unsigned char *)&((struct sockaddr_in *)&local)->sin_addr;
+        port = ntohs(((struct sockaddr_in *)&local)->sin_port);
+        code = ftp_command(f, "PORT %d,%d,%d,%d,%d,%d",
+                           a[0], a[1], a[2], a[3], port >> 8, port & 255);
+    }
+    else
+    {
+        port = ntohs(((struct sockaddr_in6 *)&local)->sin6_port);
+        inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&local)->sin6_addr, host, sizeof(host));
+        code = ftp_command(f, "EPRT |2|%s|%d|", host, port);
+    }
+
+    if (code != 200)
+    {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* Start fetching f->path from byte pos of it. Returns 0 with the data
+   connection in f->data, or -1. */
+static int ftp_retr(struct ftp *f, off_t pos)
+{
+    struct pollfd p;
+    int listener = -1;
+    int code;
+
+    if ((f->data = ftp_passive(f)) < 0 && (listener = ftp_active(f)) < 0)
+        return -1;
+
+    if (pos > 0 && ftp_command(f, "REST %lld", (long long)pos) != 350)
+        goto fail;
+
+    if ((code = ftp_command(f, "RETR %s", f->path)) != 150 && code != 125)
+        goto fail;
+
+    if (listener != -1)
+    {
+        p.fd = listener;
+        p.events = POLLIN;
+        if (poll(&p, 1, options.connect_timeout) <= 0
+            || (f->data = accept(listener, NULL, NULL)) < 0)
+            goto fail;
+        close(listener);
+    }
+
+    f->offset = pos;
+
+    return 0;
+
+fail:
+    if (f->data != -1)
+        close(f->data);
+    f->data = -1;
+    if (listener != -1)
+        close(listener);
+
+    return -1;
+}
+
+/* Stop a transfer part way through. Servers send 426 for the transfer
+   and then 226 for the ABOR, or just 226 if it was over anyway, or 225,
+   so take whatever comes. Returns 0 if the connection can be used again. */
+static int ftp_abort(struct ftp *f)
+{
+    int code;
+
+    if (send_all(f->fd, "ABOR\r\n", 6) < 0)
+        return -1;
+
+    do
+    {
+        if ((code = ftp_reply(f)) < 0)
+            return -1;
+    }
+    while (code != 225 && code != 226);
+
+    while (ftp_ready(f, FTP_ABORT_WAIT))
+    {
+        if (ftp_reply(f) < 0)
+            return -1;
+    }
+
+    return 0;
+}
+
+/* Done with the transfer on f: hear the server out if it's complete, or
+   stop it. Returns 0 if the connection can be used again. */
+static int ftp_end(struct ftp *f)
+{
+    int code;
+
+    if (f->data == -1)
+        return 0;
+
+    close(f->data);
+    f->data = -1;
+
+    if (f->size >= 0 && f->offset >= f->size)
+        return ((code = ftp_reply(f)) == 226 || code == 250) ? 0 : -1;
+
+    return ftp_abort(f);
+}
+
+struct ftp *ftp_open(char *arg)
+{
+    char *host;
+    int port;
+    char *path;
+    char *user = "anonymous";
+    char *pass = "smpeguser@";
+    char *p;
+    struct ftp *f;
+    int code;
+
+    /* Check for URL syntax */
+    if (strncmp(arg, "ftp://", strlen("ftp://")))
+        return (NULL);
+
+    /* Parse URL: ftp://[user[:pass]@]host[:port]/path */
+    port = 21;
+    host = arg + strlen("ftp://");
+    if ((path = strchr(host, '/')) == NULL)
+        return (NULL);
+    *path++ = 0;
+
+    if ((p = strrchr(host, '@')))
+    {
+        *p = 0;
+        user = host;
+        host = p + 1;
+        if ((p = strchr(user, ':')))
+        {
+            *p++ = 0;
+            pass = p;
+        }
+    }
+
+    host = host_port(host, &port);
+
+    while ((f = ftp_connect(host, port, user, pass)))
+    {
+        snprintf(f->path, sizeof(f->path), "%s", path);
+        f->retries = 0;
+
+        /* without SIZE there's no seeking, or knowing a dropped transfer
+           from a finished one */
+        f->size = -1;
+        if ((code = ftp_command(f, "SIZE %s", path)) == 213)
+            f->size = strtoll(f->reply + 4, NULL, 10);
+
+        /* an idle connection may have gone stale in a way the pool
+           couldn't tell: try a new one */
+        else if (code < 0 && f->reused)
+        {
+            ftp_drop(f);
+            continue;
+        }
+
+        if (ftp_retr(f, 0) == 0)
+            return f;
+
+        fprintf(stderr, "ftp_open: %s\n", f->reply);
+        ftp_drop(f);
+        break;
+    }
+
+    return NULL;
+}
+
+/* Done with f: back to the pool if the server is ready for another
+   transfer on it, or else close it */
+void ftp_close(struct ftp *f)
+{
+    int i;
+
+    if (ftp_end(f) == 0 && f->pos == f->len)
+    {
+        f->reused = 0;
+
+        for (i = 0; i < FTP_POOL_SIZE; i++)
+        {
+            if (!ftp_pool[i])
+            {
+                ftp_pool[i] = f;
+                return;
+            }
+        }
+
+        /* pool's full: make room by dropping the first */
+        ftp_drop(ftp_pool[0]);
+        memmove(ftp_pool, ftp_pool + 1, (FTP_POOL_SIZE - 1) * sizeof(struct ftp *));
+        ftp_pool[FTP_POOL_SIZE - 1] = f;
+        return;
+    }
+
+    ftp_drop(f);
+}
+
+/* Carry on with f's file from byte pos of it, with REST and another RETR,
+   over a new control connection if the old one won't do */
+int ftp_reopen(struct ftp *f, off_t pos)
+{
+    struct ftp *n;
+
+    if (f->size < 0 || pos >= f->size)
+        return -1;
+
+    if (ftp_end(f) == 0 && ftp_retr(f, pos) == 0)
+        return 0;
+
+    if (!(n = ftp_login(f->host, f->port, f->user, f->pass)))
+        return -1;
+
+    snprintf(n->path, sizeof(n->path), "%s", f->path);
+    n->size = f->size;
+    n->retries = f->retries;
+
+    if (ftp_retr(n, pos) < 0)
+    {
+        ftp_drop(n);
+        return -1;
+    }
+
+    close(f->fd);
+    *f = *n;
+    free(n);
+
+    return 0;
+}
+
+/* The data connection closed: if that was short of the end of the file,
+   pick up where it left off */
+int ftp_resume(struct ftp *f)
+{
+    if (f->size < 0 || f->offset >= f->size || f->retries >= FTP_RETRIES)
+        return -1;
+
+    f->retries++;
+
+    return ftp_reopen(f, f->offset);
+}
+
+/* How far behind in ms sending may fall, after a pause or a stall, before
+   it stops trying to catch up and carries on from now */
+#define SEND_BEHIND 250
+
+/* How far ahead of its time in ms a frame may be sent, so that frames go
+   out a few at a time */
+#define SEND_LEAD 20
+
+/* Open sockets for each of the comma-separated raw://host:port URLs in
+   list, unicast or multicast, for an RTP stream of MPEG audio (RFC 2250) */
+struct sender *sender_open(char *list)
+{
+    struct sender *s;
+    struct addrinfo *ai;
+    char *url, *host;
+    unsigned long seed;
+    int port;
+    int family;
+
+    if (!(s = calloc(1, sizeof(struct sender))))
+        return NULL;
+
+    s->fd[0] = s->fd[1] = -1;
+
+    for (url = strtok(list, ","); url; url = strtok(NULL, ","))
+    {
+        if (strncmp(url, "raw://", strlen("raw://")) || s->ndests == SEND_MAX_DESTS)
+        {
+            fprintf(stderr, "Can't send to %s\n", url);
+            continue;
+        }
+
+        port = 0;
+        host = host_port(url + strlen("raw://"), &port);
+
+        if (!(ai = resolve(host, SOCK_DGRAM)))
+            continue;
+
+        family = (ai->ai_family == AF_INET6);
+
+        if (s->fd[family] == -1 && (s->fd[family] = socket(ai->ai_family, SOCK_DGRAM, 0)) < 0)
+        {
+            perror("sender_open");
+            continue;
+        }
+
+        s->dest_len[s->ndests] = address_port(ai, port, &s->dest[s->ndests]);
+        s->ndests++;
+    }
+
+    if (!s->ndests)
+    {
+        sender_close(s);
+        return NULL;
+    }
+
+    /* RFC 3550: the source, sequence number and timestamp start off
+       different each time */
+    seed = ((unsigned long)now_ms() ^ ((unsigned long)getpid() << 16)) * 2654435761UL;
+    s->ssrc = seed & 0xffffffffUL;
+    s->seq = seed >> 7;
+    s->timestamp = (seed * 2654435761UL) & 0xffffffffUL;
+
+    return s;
+}
+
+/* Send the datagrams gathered to every destination, as few system calls
+   as it takes */
+void sender_flush(struct sender *s)
+{
+    struct msghdr hdrs[SEND_BATCH * SEND_MAX_DESTS];
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr msgs[SEND_BATCH * SEND_MAX_DESTS];
+#endif
+    struct iovec iov[SEND_BATCH];
+    int family, d, i, n, done, got;
+
+    for (i = 0; i < s->npackets; i++)
+    {
+        iov[i].iov_base = s->packets[i];
+        iov[i].iov_len = s->len[i];
+    }
+
+    for (family = 0; family < 2; family++)
+    {
+        if (s->fd[family] == -1)
+            continue;
+
+        /* npackets to a destination, one destination after another */
+        n = 0;
+        for (d = 0; d < s->ndests; d++)
+        {
+            if ((s->dest[d].ss_family == AF_INET6) != family)
+                continue;
+
+            for (i = 0; i < s->npackets; i++, n++)
+            {
+                memset(&hdrs[n], 0, sizeof(hdrs[n]));
+                hdrs[n].msg_name = &s->dest[d];
+                hdrs[n].msg_namelen = s->dest_len[d];
+                hdrs[n].msg_iov = &iov[i];
+                hdrs[n].msg_iovlen = 1;
+#ifdef HAVE_SENDMMSG
+                msgs[n].msg_hdr = hdrs[n];
+                msgs[n].msg_len = 0;
+#endif
+            }
+        }
+
+        for (done = 0; done < n; done += got)
+        {
+#ifdef HAVE_SENDMMSG
+            got = sendmmsg(s->fd[family], msgs + done, n - done, 0);
+#else
+            got = (sendmsg(s->fd[family], &hdrs[done], 0) < 0) ? -1 : 1;
+#endif
+            if (got < 0)
+            {
+                if (errno == EINTR)
+                {
+                    got = 0;
+                    continue;
+                }
+
+                /* a destination that isn't there shouldn't hold up the
+                   others; the rest of this lot is lost to it, and that's
+                   all */
+                got = s->npackets - done % s->npackets;
+            }
+        }
+    }
+
+    s->npackets = 0;
+}
+
+/* Send a frame of duration, in as many datagrams as it takes, once it's
+   nearly time for it to be played */
+void sender_frame(struct sender *s, unsigned char const *frame, size_t len, mad_timer_t duration)
+{
+    unsigned char *p;
+    unsigned long timestamp;
+    long ahead;
+    size_t off, n;
+
+    if (!s->start)
+        s->start = now_ms();
+
+    ahead = mad_timer_count(s->sent, MAD_UNITS_MILLISECONDS) - (now_ms() - s->start);
+
+    if (ahead > SEND_LEAD)
+    {
+        sender_flush(s);
+        poll(NULL, 0, ahead - SEND_LEAD);
+    }
+
+    else if (ahead < -SEND_BEHIND)
+        s->start -= ahead;
+
+    /* RFC 2250: a 90kHz clock */
+    timestamp = s->timestamp + (unsigned long)s->sent.seconds * 90000
+        + mad_timer_fraction(s->sent, 90000);
+
+    for (off = 0; off < len; off += n)
+    {
+        if (s->npackets == SEND_BATCH)
+            sender_flush(s);
+
+        n = (len - off > SEND_PAYLOAD) ? SEND_PAYLOAD : len - off;
+        p = s->packets[s->npackets];
+
+        /* RTP version 2, payload type 14, MPEG audio */
+        p[0] = 0x80;
+        p[1] = 14;
+        p[2] = s->seq >> 8;
+        p[3] = s->seq & 0xff;
+        p[4] = (timestamp >> 24) & 0xff;
+        p[5] = (timestamp >> 16) & 0xff;
+        p[6] = (timestamp >> 8) & 0xff;
+        p[7] = timestamp & 0xff;
+        p[8] = (s->ssrc >> 24) & 0xff;
+        p[9] = (s->ssrc >> 16) & 0xff;
+        p[10] = (s->ssrc >> 8) & 0xff;
+        p[11] = s->ssrc & 0xff;
+
+        /* where in the frame this part of it starts */
+        p[12] = p[13] = 0;
+        p[14] = (off >> 8) & 0xff;
+        p[15] = off & 0xff;
+
+        memcpy(p + 16, frame + off, n);
+        s->len[s->npackets++] = 16 + n;
+        s->seq++;
+    }
+
+    mad_timer_add(&s->sent, duration);
+}
+
+void sender_close(struct sender *s)
+{
+    sender_flush(s);
+
+    if (s->fd[0] != -1)
+        close(s->fd[0]);
+    if (s->fd[1] != -1)
+        close(s->fd[1]);
 
-    return (accept(data_sock, NULL, NULL));
+    free(s);
 }
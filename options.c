@@ -35,6 +35,28 @@
 #include <sys/resource.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
+
+/* N bytes, Nk kilobytes, or Nms milliseconds of audio */
+static int parse_watermark(char *arg, watermark *w)
+{
+    char *end;
+
+    w->amount = strtol(arg, &end, 10);
+    w->ms = 0;
+
+    if (end == arg || w->amount < 0)
+        return -1;
+
+    if (strcmp(end, "ms") == 0)
+        w->ms = 1;
+    else if (strcmp(end, "k") == 0 || strcmp(end, "K") == 0)
+        w->amount *= 1024;
+    else if (*end)
+        return -1;
+
+    return 0;
+}
 
 void parse_options(int argc, char *argv[], playlist *pl)
 {
@@ -69,8 +91,6 @@ void parse_options(int argc, char *argv[], playlist *pl)
         { "doublespeed", 1, 0, 'd' },
         { "halfspeed", 1, 0, 'h' },
         { "scale", 1, 0, 'f' },
-        { "buffer", 1, 0, 'b' },
-        { "proxy", 1, 0, 'p' },
         { "rate", 1, 0, 'r' },
             
         /* The following are all implemented. */
@@ -78,7 +98,20 @@ void parse_options(int argc, char *argv[], playlist *pl)
         /* These take a parameter and have no short equiv */
         { "au", 1, 0, 'A' },
         { "cdr", 1, 0, 'D' },
+        { "high-watermark", 1, 0, 'W' },
+        { "low-watermark", 1, 0, 'Y' },
+        { "connect-timeout", 1, 0, 'J' },
+        { "jitter", 1, 0, 'j' },
+        { "send", 1, 0, 'S' },
+        { "serve", 1, 0, 'B' },
+        { "seed", 1, 0, 'K' },
+        { "socket", 1, 0, 'M' },
+        { "status-interval", 1, 0, 'e' },
     
+        /* These take a parameter and have short equiv */
+        { "buffer", 1, 0, 'b' },
+        { "proxy", 1, 0, 'p' },
+
         /* Takes no parameters */
         { "verbose", 0, 0, 'v' },
         { "quiet", 0, 0, 'q' }, 
@@ -90,8 +123,11 @@ void parse_options(int argc, char *argv[], playlist *pl)
         { "longhelp", 0, 0, 'H' },
         { "shuffle", 0, 0, 'z' },
         { "random", 0, 0, 'Z' },
+        { "validate", 0, 0, 'Q' },
         { "remote", 0, 0, 'R' },
+        { "remote-binary", 0, 0, 'x' },
         { "stereo", 0, 0, 'T' },
+        { "low-latency", 0, 0, 'X' },
             
         /* takes parameters */
         { "frames", 1, 0, 'n' },
@@ -109,8 +145,8 @@ void parse_options(int argc, char *argv[], playlist *pl)
     options.maxframes=-1;
 
     while ((c = getopt_long(argc, argv, 
-                                "OPLTNEI824cy01mCu:d:h:f:b:p:r:G:" /* unimplemented */
-                                "A:D:vqtsVHzZRo:n:@:k:w:a:g:",     /* implemented */
+                                "OPLTNEI824cy01mCu:d:h:f:r:G:" /* unimplemented */
+                                "A:D:W:Y:XJ:j:S:B:K:M:e:Qxp:vqtsVHzZRo:n:@:k:w:a:g:b:",   /* implemented */
                         long_options, &option_index)) != -1)
     {            
         switch(c)
@@ -118,7 +154,11 @@ void parse_options(int argc, char *argv[], playlist *pl)
             case 'O': case 'P': case 'L': case 'N': case 'E': case '8':
             case '2': case '4': case 'c': case 'y': case '0': case '1': case 'm': case 'C':
             case 'u':
-            case 'U': case 'd': case 'h': case 'f': case 'b': case 'p':
+            case 'U': case 'd': case 'h': case 'f':
+                break;
+            case 'p':
+                /* "" for none, even if http_proxy is set */
+                options.proxy = strdup(optarg);
                 break;
             case 'n': 
                 options.maxframes = atol(optarg);
@@ -133,6 +173,14 @@ void parse_options(int argc, char *argv[], playlist *pl)
             case 'Z':
                 set_random_play(pl);
                 break;
+
+            case 'Q':
+                options.opt |= MPG321_VALIDATE;
+                break;
+
+            case 'K':
+                set_random_seed(pl, strtoul(optarg, NULL, 10));
+                break;
                 
             case '@': 
                 playlist_file = strdup(optarg);
@@ -150,9 +198,97 @@ void parse_options(int argc, char *argv[], playlist *pl)
             case 'R':
                 options.opt |= MPG321_REMOTE_PLAY;
                 options.opt |= MPG321_QUIET_PLAY; /* surpress other output */
-                setvbuf(stdout, NULL, _IONBF, 0);
+                /* flushed by remote_flush() after each line but @F */
+                setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
                 break;
                 
+            case 'M':
+                /* -R, over a socket */
+                options.remote_socket = optarg;
+                options.opt |= MPG321_REMOTE_PLAY;
+                options.opt |= MPG321_QUIET_PLAY;
+                break;
+
+            case 'x':
+                options.opt |= MPG321_REMOTE_BINARY;
+                break;
+
+            case 'b':
+                options.buffersize = atol(optarg) * 1024;
+                if (options.buffersize <= 0)
+                {
+                    fprintf(stderr, "Buffer size must be positive!\n");
+                    exit(1);
+                }
+                break;
+            
+            case 'W':
+                if (parse_watermark(optarg, &options.high_watermark) == -1)
+                {
+                    fprintf(stderr, "High watermark must be N, Nk or Nms!\n");
+                    exit(1);
+                }
+                break;
+
+            case 'Y':
+                if (parse_watermark(optarg, &options.low_watermark) == -1)
+                {
+                    fprintf(stderr, "Low watermark must be N, Nk or Nms!\n");
+                    exit(1);
+                }
+                break;
+
+            case 'X':
+                /* start on the first whole frame, and never stop to fill up */
+                options.high_watermark.amount = options.low_watermark.amount = 0;
+                options.high_watermark.ms = options.low_watermark.ms = 0;
+                break;
+
+            case 'J':
+                options.connect_timeout = atof(optarg) * 1000;
+                if (options.connect_timeout <= 0)
+                {
+                    fprintf(stderr, "Connect timeout must be positive!\n");
+                    exit(1);
+                }
+                break;
+
+            case 'j':
+                options.jitter = atoi(optarg);
+                if (options.jitter < 0)
+                {
+                    fprintf(stderr, "Jitter allowance must not be negative!\n");
+                    exit(1);
+                }
+                break;
+
+            case 'e':
+                options.status_interval = atol(optarg);
+                if (options.status_interval < 0)
+                {
+                    fprintf(stderr, "Status interval must not be negative!\n");
+                    exit(1);
+                }
+                break;
+
+            case 'S':
+                /* more than one are sent to together */
+                if (options.send)
+                {
+                    char *list = malloc(strlen(options.send) + strlen(optarg) + 2);
+
+                    sprintf(list, "%s,%s", options.send, optarg);
+                    free(options.send);
+                    options.send = list;
+                }
+                else
+                    options.send = strdup(optarg);
+                break;
+
+            case 'B':
+                options.serve = optarg;
+                break;
+
             case 'k':
                 options.seek = atol(optarg);
                 status = MPG321_SEEKING;
@@ -40,44 +40,488 @@
 #include <ctype.h>
 #include <errno.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <poll.h>
+
+/* Grows p to size, or gives up: a playlist that won't fit won't play */
+static
+void * playlist_grow(void *p, size_t size)
+{
+    if (!(p = realloc(p, size)))
+    {
+        fprintf(stderr, "Out of memory for the playlist!\n");
+        exit(1);
+    }
+
+    return p;
+}
 
 playlist * new_playlist()
 {
-    playlist *pl = (playlist *) malloc(sizeof(playlist));
+    playlist *pl = (playlist *) calloc(1, sizeof(playlist));
 
-    srandom(time(NULL));
+    if (!pl)
+        return NULL;
+
+    /* see --seed */
+    pl->seed = time(NULL) ^ getpid();
+    srandom(pl->seed);
         
-    pl->files = (char **) malloc(DEFAULT_PLAYLIST_SIZE * sizeof(char *));
+    pl->files = (playlist_entry *) malloc(DEFAULT_PLAYLIST_SIZE * sizeof(playlist_entry));
     pl->files_size = DEFAULT_PLAYLIST_SIZE;
-    pl->numfiles = 0;
-    pl->random_play = 0;
-    strcpy(pl->remote_file, "");
+
+    pl->arena_size = DEFAULT_PLAYLIST_SIZE * 32;
+    pl->arena = (char *) malloc(pl->arena_size);
+    pl->dirs_size = 64;
+    pl->dirs = (size_t *) malloc(pl->dirs_size * sizeof(size_t));
+    pl->dir_hash_size = 128;
+    pl->dir_hash = (int *) calloc(pl->dir_hash_size, sizeof(int));
+
+    if (!pl->files || !pl->arena || !pl->dirs || !pl->dir_hash)
+        return NULL;
+
+    /* directory 0, "", at the very start */
+    pl->arena[0] = '\0';
+    pl->arena_len = 1;
+    pl->dirs[0] = 0;
+    pl->numdirs = 1;
+
+    pl->fd = -1;
+    pl->current = -1;
     
     return pl;
 }
 
-/* not needed - one static playlist object per instance 
-void delete_playlist(playlist *pl)
+void resize_playlist(playlist *pl)
+{
+    pl->files = (playlist_entry *) playlist_grow(pl->files, (pl->files_size *= 2) * sizeof(playlist_entry));
+}
+
+/* Copies len bytes to the end of the arena, with a nul after them, and
+   returns where */
+static
+size_t arena_add(playlist *pl, char const *s, size_t len)
+{
+    size_t at = pl->arena_len;
+
+    if (at + len + 1 > pl->arena_size)
+    {
+        while (at + len + 1 > pl->arena_size)
+            pl->arena_size *= 2;
+
+        pl->arena = (char *) playlist_grow(pl->arena, pl->arena_size);
+    }
+
+    memcpy(pl->arena + at, s, len);
+    pl->arena[at + len] = '\0';
+    pl->arena_len += len + 1;
+
+    return at;
+}
+
+static
+unsigned long dir_hash(char const *dir, size_t len)
+{
+    unsigned long h = 2166136261UL;
+
+    while (len--)
+        h = ((h ^ (unsigned char)*dir++) * 16777619UL) & 0xffffffffUL;
+
+    return h;
+}
+
+/* The number of directory dir, len bytes long (with its trailing slash),
+   which is added if it's new */
+static
+int intern_dir(playlist *pl, char const *dir, size_t len)
+{
+    unsigned long h;
+    int i, d;
+
+    if (len == 0)
+        return 0;
+
+    /* hash slots hold directory numbers; 0 is "", so never in here, and
+       marks an empty slot */
+    for (h = dir_hash(dir, len) & (pl->dir_hash_size - 1); (d = pl->dir_hash[h]);
+         h = (h + 1) & (pl->dir_hash_size - 1))
+    {
+        if (memcmp(pl->arena + pl->dirs[d], dir, len) == 0 && pl->arena[pl->dirs[d] + len] == '\0')
+            return d;
+    }
+
+    if (pl->numdirs == pl->dirs_size)
+        pl->dirs = (size_t *) playlist_grow(pl->dirs, (pl->dirs_size *= 2) * sizeof(size_t));
+
+    d = pl->numdirs++;
+    pl->dirs[d] = arena_add(pl, dir, len);
+    pl->dir_hash[h] = d;
+
+    /* kept at most half full */
+    if (pl->numdirs * 2 > pl->dir_hash_size)
+    {
+        free(pl->dir_hash);
+        pl->dir_hash_size *= 2;
+        pl->dir_hash = (int *) playlist_grow(NULL, pl->dir_hash_size * sizeof(int));
+        memset(pl->dir_hash, 0, pl->dir_hash_size * sizeof(int));
+
+        for (i = 1; i < pl->numdirs; i++)
+        {
+            for (h = dir_hash(pl->arena + pl->dirs[i], strlen(pl->arena + pl->dirs[i])) & (pl->dir_hash_size - 1);
+                 pl->dir_hash[h]; h = (h + 1) & (pl->dir_hash_size - 1))
+                ;
+
+            pl->dir_hash[h] = i;
+        }
+    }
+
+    return d;
+}
+
+/* Adds name, len bytes long, after prefix (a directory ending in a slash,
+   or ""). Returns where it is in the playlist, or -1 if it wasn't added. */
+static
+int add_entry(playlist *pl, char const *prefix, char const *name, size_t len)
+{
+    char dir[PATH_MAX];
+    size_t prefix_len = strlen(prefix);
+    size_t dir_len = len;
+    int d;
+
+    while (dir_len > 0 && name[dir_len - 1] != '/')
+        dir_len--;
+
+    if (!prefix_len)
+        d = intern_dir(pl, name, dir_len);
+
+    else if (!dir_len)
+        d = intern_dir(pl, prefix, prefix_len);
+
+    else
+    {
+        /* too long to open anyway */
+        if (prefix_len + dir_len >= PATH_MAX)
+            return -1;
+
+        memcpy(dir, prefix, prefix_len);
+        memcpy(dir + prefix_len, name, dir_len);
+        d = intern_dir(pl, dir, prefix_len + dir_len);
+    }
+
+    if (pl->numfiles == pl->files_size)
+        resize_playlist(pl);
+
+    pl->files[pl->numfiles].dir = d;
+    pl->files[pl->numfiles].name = arena_add(pl, name + dir_len, len - dir_len);
+    pl->files[pl->numfiles].title = 0;
+    pl->files[pl->numfiles].length = 0;
+
+    return pl->numfiles++;
+}
+
+/* Entry i, in full, in path */
+static
+char * entry_path(playlist *pl, int i, char *path)
+{
+    snprintf(path, PATH_MAX, "%s%s", pl->arena + pl->dirs[pl->files[i].dir],
+             pl->arena + pl->files[i].name);
+
+    return path;
+}
+
+/* Entry i, in full, in pl->path */
+static
+char * playlist_path(playlist *pl, int i)
+{
+    return entry_path(pl, i, pl->path);
+}
+
+/* Adds a name from the playlist file, which if relative is relative to the
+   playlist file, and gives it the title and length given for it before */
+static
+void playlist_name(playlist *pl, char *name, size_t len)
 {
     int i;
-    for (i = 0; i < pl->numfiles; i++)
-        free(pl->files[i]);
 
-    free(pl->files);
-    free(pl);
-} */
+    /* I hate special cases... */
+    if (name[0] != '/' && !strstr(name, "://")) /* relative path or network path */
+        i = add_entry(pl, pl->directory, name, len);
 
-void resize_playlist(playlist *pl)
+    else /* absolute path */
+        i = add_entry(pl, "", name, len);
+
+    if (i != -1)
+    {
+        pl->files[i].title = pl->next_title;
+        pl->files[i].length = pl->next_length;
+    }
+
+    pl->next_title = 0;
+    pl->next_length = 0;
+}
+
+/* #EXTINF:length[ attributes],title, for the next name */
+static
+void extinf_line(playlist *pl, char *info)
 {
-    char ** temp = (char **) malloc ((pl->files_size *= 2) * sizeof(char *));
-    register int i;
-    
-    for (i = 0; i < pl->numfiles; i++)
-        temp [i] = pl->files[i];
-        
-    free (pl->files);
-    
-    pl->files = temp;
+    int quoted = 0;
+
+    pl->next_length = strtol(info, NULL, 10);
+
+    if (pl->next_length < 0)
+        pl->next_length = 0;
+
+    /* the title's after the first comma that isn't in an attribute */
+    for (; *info && (quoted || *info != ','); info++)
+    {
+        if (*info == '"')
+            quoted = !quoted;
+    }
+
+    if (*info == ',')
+    {
+        while (isspace((unsigned char)*++info))
+            ;
+
+        if (*info)
+            pl->next_title = arena_add(pl, info, strlen(info));
+    }
+}
+
+/* FileN=, TitleN= or LengthN= of a PLS playlist. Titles and lengths are
+   usually given after their file, but may be given just before it. */
+static
+void pls_line(playlist *pl, char *line, size_t len)
+{
+    char *value = strchr(line, '=');
+    long n;
+    int i;
+
+    if (!value)
+        return;
+
+    *value++ = '\0';
+
+    while (isspace((unsigned char)*value))
+        value++;
+
+    if (strncasecmp(line, "File", 4) == 0 && *value)
+        playlist_name(pl, value, line + len - value);
+
+    else if (strncasecmp(line, "Title", 5) == 0 || strncasecmp(line, "Length", 6) == 0)
+    {
+        n = strtol(line + (tolower((unsigned char)line[0]) == 't' ? 5 : 6), NULL, 10);
+
+        if (n < 1)
+            return;
+
+        i = pl->pls_first + n - 1;
+
+        if (i < pl->numfiles && tolower((unsigned char)line[0]) == 't')
+            pl->files[i].title = arena_add(pl, value, strlen(value));
+
+        else if (i < pl->numfiles)
+            pl->files[i].length = (strtol(value, NULL, 10) > 0) ? strtol(value, NULL, 10) : 0;
+
+        /* for the file that's next */
+        else if (i == pl->numfiles && tolower((unsigned char)line[0]) == 't')
+            pl->next_title = arena_add(pl, value, strlen(value));
+
+        else if (i == pl->numfiles)
+            pl->next_length = (strtol(value, NULL, 10) > 0) ? strtol(value, NULL, 10) : 0;
+    }
+}
+
+/* A line of a playlist file, len bytes long, with room after it for a nul:
+   a name, or in an M3U playlist a comment or #EXTINF, or a line of a PLS
+   playlist, if it started with [playlist] */
+static
+void playlist_line(playlist *pl, char *line, size_t len)
+{
+    /* UTF-8 byte order mark, from .m3u8 files */
+    if (pl->lines == 0 && len >= 3 && memcmp(line, "\357\273\277", 3) == 0)
+    {
+        line += 3;
+        len -= 3;
+    }
+
+    while (len > 0 && isspace((unsigned char)line[len - 1]))
+        len--;
+
+    while (len > 0 && isspace((unsigned char)*line))
+    {
+        line++;
+        len--;
+    }
+
+    if (len == 0)
+        return;
+
+    line[len] = '\0';
+
+    if (pl->lines++ == 0 && strcasecmp(line, "[playlist]") == 0)
+    {
+        pl->pls = 1;
+        pl->pls_first = pl->numfiles;
+    }
+
+    else if (pl->pls)
+        pls_line(pl, line, len);
+
+    else if (strncmp(line, "#EXTINF:", 8) == 0)
+        extinf_line(pl, line + 8);
+
+    /* #EXTM3U and other comments */
+    else if (line[0] != '#')
+        playlist_name(pl, line, len);
+}
+
+/* Reads the next block of the playlist file, if it's still being read, and
+   adds the lines in it. Returns 0 once it's all been read. */
+static
+int playlist_read(playlist *pl)
+{
+    char *line, *end, *nl;
+    ssize_t got;
+
+    if (pl->fd == -1)
+        return 0;
+
+    /* a line longer than a block: not a file name, so skip it */
+    if (pl->block_len == PLAYLIST_BLOCK)
+    {
+        pl->block_len = 0;
+        pl->skip_line = 1;
+    }
+
+    got = read(pl->fd, pl->block + pl->block_len, PLAYLIST_BLOCK - pl->block_len);
+
+    if (got < 0 && errno == EINTR)
+        return 1;
+
+    if (got <= 0)
+    {
+        if (got < 0)
+            perror("playlist");
+
+        /* the last line, with no newline after it */
+        if (!pl->skip_line)
+            playlist_line(pl, pl->block, pl->block_len);
+
+        if (pl->fd != fileno(stdin))
+            close(pl->fd);
+
+        pl->fd = -1;
+        free(pl->block);
+        pl->block = NULL;
+
+        if (pl->show_length)
+            show_playlist_length(pl);
+
+        return 0;
+    }
+
+    line = pl->block;
+    end = pl->block + pl->block_len + got;
+
+    while ((nl = memchr(line, '\n', end - line)))
+    {
+        if (pl->skip_line)
+            pl->skip_line = 0;
+        else
+            playlist_line(pl, line, nl - line);
+
+        line = nl + 1;
+    }
+
+    pl->block_len = end - line;
+    memmove(pl->block, line, pl->block_len);
+
+    return 1;
+}
+
+/* Reads the rest of the playlist file, for whatever needs it all */
+static
+void playlist_finish(playlist *pl)
+{
+    while (playlist_read(pl))
+        ;
+}
+
+/* --validate: has what's coming up checked, as far ahead as it goes */
+static
+void playlist_feed(playlist *pl)
+{
+    char path[PATH_MAX];
+
+    for (; pl->validated < pl->numfiles && validate_room(pl->validator, pl->next) > 0; pl->validated++)
+        validate_add(pl->validator, pl->validated, entry_path(pl, pl->validated, path));
+}
+
+/* Reads what's come down a piped playlist while a file plays, without
+   waiting for more, and no more than PLAYLIST_LOOKAHEAD entries ahead, so
+   whatever's writing it is held back till they're wanted */
+void playlist_poll(playlist *pl)
+{
+    struct pollfd pfd;
+
+    if (!pl->streaming || pl->fd == -1 || pl->numfiles - pl->next >= PLAYLIST_LOOKAHEAD)
+        return;
+
+    pfd.fd = pl->fd;
+    pfd.events = POLLIN;
+
+    if (poll(&pfd, 1, 0) == 1)
+    {
+        playlist_read(pl);
+
+        if (pl->validator)
+            playlist_feed(pl);
+    }
+}
+
+static
+int is_directory(char *path)
+{
+    struct stat st;
+
+    return !strstr(path, "://") && stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+/* Reads the rest of the playlist file, and puts the files in the
+   directories in it in their place, for shuffling or random play */
+static
+void playlist_expand(playlist *pl)
+{
+    char path[PATH_MAX];
+    struct walk *w;
+    int i, n, kept = 0;
+
+    if (pl->expanded)
+        return;
+
+    pl->expanded = 1;
+
+    playlist_finish(pl);
+
+    for (i = 0, n = pl->numfiles; i < n; i++)
+    {
+        if (!is_directory(playlist_path(pl, i)) || !(w = walk_open(pl->path)))
+        {
+            pl->files[kept++] = pl->files[i];
+            continue;
+        }
+
+        while (walk_next(w, path, PATH_MAX))
+            add_entry(pl, "", path, strlen(path));
+
+        walk_close(w);
+    }
+
+    /* what was found goes after what was kept */
+    memmove(pl->files + kept, pl->files + n, (pl->numfiles - n) * sizeof(playlist_entry));
+    pl->numfiles -= n - kept;
 }
 
 void set_random_play(playlist *pl)
@@ -85,27 +529,97 @@ void set_random_play(playlist *pl)
     pl->random_play = 1;
 }
 
+/* So that a shuffled or random run can be played again the same */
+void set_random_seed(playlist *pl, unsigned int seed)
+{
+    pl->seed = seed;
+    srandom(seed);
+}
+
+/* A random number from 0 to n - 1, each as likely as the others */
+static
+long random_below(long n)
+{
+    /* random() gives 31 bits; the top of the range that doesn't divide
+       evenly by n would favour the low numbers */
+    unsigned long limit = 0x80000000UL - 0x80000000UL % n;
+    unsigned long r;
+
+    while ((r = random()) >= limit)
+        ;
+
+    return r % n;
+}
+
+/* Fisher-Yates */
 void shuffle_files (playlist *pl)
 {
+    int i, j;
+    playlist_entry swap;
+
+    playlist_expand(pl);
+
+    for (i = pl->numfiles - 1; i > 0; i--)
+    {
+        j = random_below(i + 1);
+
+        swap = pl->files[i];
+        pl->files[i] = pl->files[j];
+        pl->files[j] = swap;
+    }
+}
+
+/* Where x goes in this round's random order of 0 .. 2^random_bits - 1: a
+   small Feistel network, keyed afresh each round, so no more than the
+   keys need be kept however long the playlist */
+static
+unsigned long random_order(playlist *pl, unsigned long x)
+{
+    int half = pl->random_bits / 2;
+    unsigned long mask = (1UL << half) - 1;
+    unsigned long left = x >> half, right = x & mask, f;
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        f = ((right ^ pl->random_keys[i]) * 2654435761UL) & 0xffffffffUL;
+        f = ((f ^ (f >> 16)) * 0x45d9f3bUL) & 0xffffffffUL;
+        f ^= f >> 16;
+
+        f = left ^ (f & mask);
+        left = right;
+        right = f;
+    }
+
+    return (left << half) | right;
+}
+
+/* The next entry for -Z: every one once, in random order, then again in
+   another */
+static
+int random_next(playlist *pl)
+{
+    unsigned long x;
     int i;
-    int a, b;
-    char *swap;
 
-    for (i = 0; i < 100 * pl->numfiles; i++)
+    for (;;)
     {
-        a = pl->numfiles * ((double)random()/RAND_MAX);
-        b = pl->numfiles * ((double)random()/RAND_MAX);
+        if (!pl->random_bits || pl->random_pos >> pl->random_bits)
+        {
+            for (pl->random_bits = 2; (1UL << pl->random_bits) < (unsigned long)pl->numfiles;
+                 pl->random_bits += 2)
+                ;
 
-        /* because if random()/RAND_MAX == 1, we will be 
-           referencing an index outside the array */
-        if (a == pl->numfiles)
-            a--;
-        if (b == pl->numfiles)
-            b--;
+            for (i = 0; i < 4; i++)
+                pl->random_keys[i] = random();
 
-        swap = pl->files[a];
-        pl->files[a] = pl->files[b];
-        pl->files[b] = swap;
+            pl->random_pos = 0;
+        }
+
+        /* the order covers a power of four; what's past the end of the
+           playlist is passed over */
+        if ((x = random_order(pl, pl->random_pos++)) < (unsigned long)pl->numfiles)
+            return x;
     }
 }
 
@@ -114,7 +628,7 @@ void trim_whitespace(char *str)
     char *ptr = str;
     register int pos = strlen(str)-1;
 
-    while(isspace(ptr[pos]))
+    while(pos >= 0 && isspace(ptr[pos]))
         ptr[pos--] = '\0';
     
     while(isspace(*ptr))
@@ -125,8 +639,6 @@ void trim_whitespace(char *str)
     
 char * get_next_file(playlist *pl, buffer *buf)
 {
-    static int i = 0;
-    
     if (options.opt & MPG321_REMOTE_PLAY)
     {
         while (strlen(pl->remote_file) == 0 && !quit_now)
@@ -137,35 +649,136 @@ char * get_next_file(playlist *pl, buffer *buf)
     
     if (!pl->random_play)
     {
-        if (i == pl->numfiles)
-            return NULL;
-        
-        return pl->files[i++];
+        for (;;)
+        {
+            /* the files in a directory, as they're found */
+            if (pl->walk && walk_next(pl->walk, pl->path, PATH_MAX))
+            {
+                pl->current = -1;
+                return pl->path;
+            }
+
+            if (pl->walk)
+            {
+                walk_close(pl->walk);
+                pl->walk = NULL;
+            }
+
+            /* play can start before the playlist file has all been read,
+               and a piped one is waited for here */
+            while (pl->next == pl->numfiles && playlist_read(pl))
+                ;
+
+            if (pl->next == pl->numfiles)
+                return NULL;
+
+            /* --validate: have what's coming up checked while this plays,
+               and pass over this if it won't play */
+            if (pl->validator)
+            {
+                playlist_feed(pl);
+
+                if (!validate_result(pl->validator, pl->next))
+                {
+                    pl->next++;
+                    continue;
+                }
+            }
+
+            pl->current = pl->next;
+            playlist_path(pl, pl->next++);
+
+            if (!is_directory(pl->path) || !(pl->walk = walk_open(pl->path)))
+                return pl->path;
+        }
     }
     
     else
     {
+        playlist_expand(pl);
+
         if (!pl->numfiles)
             return NULL;
 
-        i = pl->numfiles * ((double)random()/RAND_MAX);
-        
-        if (i == pl->numfiles) i--;
-        
-        return pl->files[i];
+        pl->current = random_next(pl);
+        return playlist_path(pl, pl->current);
     }
 }
 
-void add_cmdline_files(playlist *pl, char *argv[])
+/* The title the playlist gave the file last given out, or NULL */
+char * current_title(playlist *pl)
+{
+    if (pl->current == -1 || !pl->files[pl->current].title)
+        return NULL;
+
+    return pl->arena + pl->files[pl->current].title;
+}
+
+/* The length in seconds the playlist gave the file last given out, or 0 */
+long current_length(playlist *pl)
+{
+    if (pl->current == -1)
+        return 0;
+
+    return pl->files[pl->current].length;
+}
+
+/* The length in seconds of everything in the playlist, as far as it says;
+   how many it doesn't say for go in unknown */
+static
+long playlist_length(playlist *pl, int *unknown)
 {
+    long total = 0;
     int i;
-    for (i = optind; argv[i]; ++i )
+
+    *unknown = 0;
+
+    for (i = 0; i < pl->numfiles; i++)
     {
-        if (pl->numfiles == pl->files_size)
-            resize_playlist(pl);
+        if (pl->files[i].length)
+            total += pl->files[i].length;
+        else
+            (*unknown)++;
+    }
 
-        pl->files[(pl->numfiles)++] = strdup(argv[i]);
+    return total;
+}
+
+/* -v: "Playlist: N files, H:MM:SS", now if the playlist file has all been
+   read, or else once playlist_read() gets to the end of it */
+void show_playlist_length(playlist *pl)
+{
+    long total;
+    int unknown;
+
+    if (pl->fd != -1)
+    {
+        pl->show_length = 1;
+        return;
     }
+
+    pl->show_length = 0;
+    total = playlist_length(pl, &unknown);
+
+    fprintf(stderr, "Playlist: %d files, %ld:%02ld:%02ld", pl->numfiles,
+            total / 3600, total / 60 % 60, total % 60);
+
+    if (unknown)
+        fprintf(stderr, ", %d of them of unknown length", unknown);
+
+    fprintf(stderr, "\n");
+}
+
+void add_cmdline_files(playlist *pl, char *argv[])
+{
+    int i;
+
+    /* after everything in the playlist file */
+    if (argv[optind])
+        playlist_finish(pl);
+
+    for (i = optind; argv[i]; ++i )
+        add_entry(pl, "", argv[i], strlen(argv[i]));
 }
 
 void play_remote_file(playlist *pl, char *file)
@@ -181,64 +794,45 @@ void clear_remote_file(playlist *pl)
 
 void add_file(playlist *pl, char *file)
 {
-    if (pl->numfiles == pl->files_size)
-         resize_playlist(pl);
-
-    pl->files[pl->numfiles++] = strdup(file);
+    add_entry(pl, "", file, strlen(file));
 }
 
 void load_playlist(playlist *pl, char *filename)
 {
-    FILE *plist;
-    char playlist_buf[PATH_MAX];
-    char *directory;
-    int dirlen;
+    char *copy, *directory;
+    struct stat st;
 
     if (strncmp(filename, "-", 1) == 0)
     {
-        plist = stdin;
+        pl->fd = fileno(stdin);
     }
 
-    else if(!(plist = fopen(filename,"r")))
+    else if ((pl->fd = open(filename, O_RDONLY)) == -1)
     {
         mpg321_error(filename);
         exit(1);
     }
 
     /* prepend the directory of the playlist file on to each filename. */
-    directory = strdup(filename);
-    directory = dirname(directory);
-
-    dirlen = strlen(directory);
-
-    while (fgets(playlist_buf, PATH_MAX, plist) != NULL)
-    {
-        trim_whitespace(playlist_buf);
-
-        if (strlen(playlist_buf) == 0)
-            continue;                
-
-        if (pl->numfiles == pl->files_size)
-            resize_playlist(pl);
-
-        /* I hate special cases... */
-        if(playlist_buf[0] != '/' && !strstr(playlist_buf, "://")) /* relative path  or network path */
-        {
-            /* +2 because of null terminating character plus / */
-            pl->files[pl->numfiles] = malloc(strlen(playlist_buf) + dirlen + 2);
-            strcpy(pl->files[pl->numfiles], directory);
-            strcat(pl->files[pl->numfiles], "/");
-            strcat(pl->files[pl->numfiles], playlist_buf);
-        }
-
-        else /* absolute path */
-        {
-            pl->files[pl->numfiles] = strdup(playlist_buf);
-        }
-
-        pl->numfiles++;
-    }
-    
-    if (plist != stdin)
-        fclose(plist);
+    copy = strdup(filename);
+    directory = dirname(copy);
+
+    pl->directory = (char *) playlist_grow(NULL, strlen(directory) + 2);
+    strcpy(pl->directory, directory);
+    strcat(pl->directory, "/");
+    free(copy);
+
+    /* +1 for the nul after a last line */
+    pl->block = (char *) playlist_grow(NULL, PLAYLIST_BLOCK + 1);
+    pl->block_len = 0;
+    pl->skip_line = 0;
+    pl->lines = 0;
+    pl->pls = 0;
+
+    /* a pipe is read from as what's written to it is wanted, or turns up;
+       anything else, the first block now, the rest as it's played */
+    pl->streaming = fstat(pl->fd, &st) == 0 && !S_ISREG(st.st_mode);
+
+    if (!pl->streaming)
+        playlist_read(pl);
 }
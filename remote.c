@@ -29,56 +29,688 @@
 
 #include "mpg321.h"
 
-#include <sys/time.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
 
-char remote_input_buf[PATH_MAX + 5];
+/* Commands come in on stdin (or --socket, below), which a thread of its
+   own reads into a ring, so that between frames all there is to do is look
+   at how many whole lines are waiting, rather than a select() each frame. */
+
+static char ring[REMOTE_RING];
+static size_t ring_head, ring_len;
+
+/* whole lines in the ring; changed with the lock held, but atomically, as
+   it's looked at without the lock between frames */
+static int lines_waiting;
+static int input_ended;
+
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_changed = PTHREAD_COND_INITIALIZER;
+static pthread_t reader;
 
 static
-enum mad_flow remote_parse_input(buffer *buf, playlist *pl)
+void ring_put(char c)
 {
-    char input[PATH_MAX + 5]; /* for filename as well as input and space */
-    char new_remote_input_buf[PATH_MAX + 5];
-    char *arg;
-    int numread;
-    int alreadyread;
-    int linelen;
+    /* a line that won't fit is lost, rather than wait on it forever */
+    while (ring_len == REMOTE_RING)
+    {
+        if (!lines_waiting)
+            ring_len = 0;
+        else
+            pthread_cond_wait(&ring_changed, &ring_lock);
+    }
+
+    ring[(ring_head + ring_len++) % REMOTE_RING] = c;
+
+    if (c == '\n')
+        __atomic_add_fetch(&lines_waiting, 1, __ATOMIC_RELEASE);
+}
+
+static
+void * remote_reader(void *arg)
+{
+    char buf[512];
+    ssize_t got, i;
+
+    for (;;)
+    {
+        if ((got = read(0, buf, sizeof(buf))) == -1 && errno == EINTR)
+            continue;
+
+        pthread_mutex_lock(&ring_lock);
+
+        if (got <= 0)
+        {
+            /* a last line with no newline still counts */
+            if (ring_len && ring[(ring_head + ring_len - 1) % REMOTE_RING] != '\n')
+                ring_put('\n');
+
+            input_ended = 1;
+            pthread_cond_broadcast(&ring_changed);
+            pthread_mutex_unlock(&ring_lock);
+            return NULL;
+        }
+
+        for (i = 0; i < got; i++)
+            ring_put(buf[i]);
+
+        pthread_cond_broadcast(&ring_changed);
+        pthread_mutex_unlock(&ring_lock);
+    }
+}
+
+/* With --socket, the same commands come from any number of clients of a
+   Unix domain socket, and what would go to stdout goes to all of them.
+   Each is written to only as fast as it reads, from a buffer of its own;
+   one that falls behind misses all but the latest @F line, rather than
+   hold up play. */
+
+struct client
+{
+    int fd;
+
+    /* the line being read */
+    char in[PATH_MAX + 5];
+    size_t in_len;
+
+    /* what's to be written, and the latest @F line, which goes after it */
+    char *out;
+    size_t out_len;
+    char frame[128];
+    size_t frame_len;
+
+    /* it's stopped reading altogether */
+    int dead;
+};
+
+static struct client clients[REMOTE_CLIENTS];
+static int nclients;
+static int listen_fd = -1;
+static int wake[2] = { -1, -1 };
+static int woken, quitting;
+
+/* what each is sent first */
+static char hello[16];
+static size_t hello_len;
+
+/* over clients, and woken and quitting */
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* A whole line from a client, for the ring. With the ring full it's lost,
+   as waiting for room could wait on a remote_write() waiting for us. */
+static
+void ring_line(char *line, size_t len)
+{
+    size_t i;
+
+    pthread_mutex_lock(&ring_lock);
+
+    if (len < REMOTE_RING - ring_len)
+    {
+        for (i = 0; i < len; i++)
+            ring_put(line[i]);
+
+        ring_put('\n');
+        pthread_cond_broadcast(&ring_changed);
+    }
+
+    pthread_mutex_unlock(&ring_lock);
+}
+
+static
+void client_append(struct client *c, const char *data, size_t len)
+{
+    if (c->out_len + len > REMOTE_CLIENT_BUF)
+    {
+        c->dead = 1;
+        return;
+    }
+
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+}
+
+/* Output for a client; a status update (frame) replaces the one before
+   it, if that's not yet gone */
+static
+void client_queue(struct client *c, const char *line, size_t len, int frame)
+{
+    if (frame && len <= sizeof(c->frame))
+    {
+        memcpy(c->frame, line, len);
+        c->frame_len = len;
+        return;
+    }
+
+    /* the @F line before this goes before it, if there's room */
+    if (c->frame_len && c->out_len + c->frame_len + len <= REMOTE_CLIENT_BUF)
+        client_append(c, c->frame, c->frame_len);
+
+    c->frame_len = 0;
+    client_append(c, line, len);
+}
+
+/* Writes what it can to a client */
+static
+void client_flush(struct client *c)
+{
+    ssize_t sent;
+
+    if (c->frame_len && c->out_len + c->frame_len <= REMOTE_CLIENT_BUF)
+    {
+        client_append(c, c->frame, c->frame_len);
+        c->frame_len = 0;
+    }
+
+    if (!c->out_len)
+        return;
+
+    if ((sent = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1)
+    {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            c->dead = 1;
+
+        return;
+    }
+
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+}
+
+/* Reads what a client has sent, passing on whole lines */
+static
+void client_read(struct client *c)
+{
+    char buf[512];
+    ssize_t got, i;
+
+    if ((got = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT)) <= 0)
+    {
+        if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            c->dead = 1;
+
+        return;
+    }
+
+    for (i = 0; i < got; i++)
+    {
+        if (buf[i] == '\n')
+        {
+            ring_line(c->in, c->in_len);
+            c->in_len = 0;
+        }
+
+        /* the rest of a line too long to be a command is lost */
+        else if (c->in_len < sizeof(c->in) - 1)
+            c->in[c->in_len++] = buf[i];
+    }
+}
+
+static
+void client_drop(int i)
+{
+    close(clients[i].fd);
+    free(clients[i].out);
+    clients[i] = clients[--nclients];
+}
+
+static
+void client_accept(void)
+{
+    struct client *c;
+    int fd;
+
+    if ((fd = accept(listen_fd, NULL, NULL)) == -1)
+        return;
+
+    if (nclients == REMOTE_CLIENTS)
+    {
+        close(fd);
+        return;
+    }
+
+    c = &clients[nclients];
+    memset(c, 0, sizeof(struct client));
+    c->fd = fd;
+
+    if (!(c->out = malloc(REMOTE_CLIENT_BUF)))
+    {
+        close(fd);
+        return;
+    }
+
+    nclients++;
+    client_queue(c, hello, hello_len, 0);
+}
+
+static
+void * remote_serve(void *arg)
+{
+    struct pollfd fds[REMOTE_CLIENTS + 2];
+    char buf[64];
+    int i, n;
+
+    pthread_mutex_lock(&clients_lock);
+
+    while (!quitting)
+    {
+        woken = 0;
+
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = wake[0];
+        fds[1].events = POLLIN;
+
+        for (i = 0, n = nclients; i < n; i++)
+        {
+            fds[i + 2].fd = clients[i].fd;
+            fds[i + 2].events = POLLIN;
+
+            if (clients[i].out_len || clients[i].frame_len)
+                fds[i + 2].events |= POLLOUT;
+        }
+
+        pthread_mutex_unlock(&clients_lock);
+
+        if (poll(fds, n + 2, -1) == -1)
+        {
+            pthread_mutex_lock(&clients_lock);
+            continue;
+        }
+
+        if (fds[1].revents)
+            while (read(wake[0], buf, sizeof(buf)) > 0)
+                ;
+
+        pthread_mutex_lock(&clients_lock);
+
+        /* from the end, as a client dropped is replaced by the last */
+        for (i = n - 1; i >= 0; i--)
+        {
+            if (fds[i + 2].revents & (POLLIN | POLLHUP | POLLERR))
+                client_read(&clients[i]);
+
+            if (fds[i + 2].revents & POLLOUT)
+                client_flush(&clients[i]);
+        }
+
+        for (i = nclients - 1; i >= 0; i--)
+        {
+            if (clients[i].dead)
+                client_drop(i);
+        }
+
+        if (fds[0].revents & POLLIN)
+            client_accept();
+    }
+
+    /* whatever can go without waiting */
+    while (nclients)
+    {
+        client_flush(&clients[nclients - 1]);
+        client_drop(nclients - 1);
+    }
+
+    pthread_mutex_unlock(&clients_lock);
+
+    return NULL;
+}
+
+/* Output for the controller, to stdout or to each client of --socket;
+   frame says it's a status update, which a client behind on them may miss.
+   It goes on the next remote_flush(): events other than @F straight away,
+   and @F lines with the next of those or a status interval later. */
+static
+void remote_write(const char *data, size_t len, int frame)
+{
+    int i;
+
+    if (listen_fd == -1)
+    {
+        fwrite(data, 1, len, stdout);
+        return;
+    }
+
+    pthread_mutex_lock(&clients_lock);
+
+    for (i = 0; i < nclients; i++)
+        client_queue(&clients[i], data, len, frame);
+
+    pthread_mutex_unlock(&clients_lock);
+}
+
+static
+void remote_printf(int frame, const char *format, ...)
+{
+    char line[PATH_MAX + ICY_META_SIZE]; /* for a filename or ICY metadata */
+    va_list ap;
+    int len;
+
+    va_start(ap, format);
+    len = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+
+    if (len <= 0)
+        return;
+
+    if (len >= (int)sizeof(line))
+    {
+        len = sizeof(line) - 1;
+        line[len - 1] = '\n';
+    }
+
+    remote_write(line, len, frame);
+}
+
+/* With --remote-binary, each event is a record instead of an @ line: two
+   bytes giving the length of the whole record, a byte of type (the letter
+   of the line it stands for) and one of kind, then fields of four bytes,
+   then for some, text with no NUL. Numbers are most significant byte
+   first. */
+static
+size_t remote_record(char *rec, size_t size, int type, int kind,
+                     long *fields, int nfields, const char *text, size_t text_len)
+{
+    size_t len = 4;
+    int i;
+
+    for (i = 0; i < nfields; i++, len += 4)
+    {
+        rec[len] = (fields[i] >> 24) & 255;
+        rec[len + 1] = (fields[i] >> 16) & 255;
+        rec[len + 2] = (fields[i] >> 8) & 255;
+        rec[len + 3] = fields[i] & 255;
+    }
+
+    if (text_len > size - len)
+        text_len = size - len;
+
+    memcpy(rec + len, text, text_len);
+    len += text_len;
+
+    rec[0] = (len >> 8) & 255;
+    rec[1] = len & 255;
+    rec[2] = type;
+    rec[3] = kind;
+
+    return len;
+}
+
+static
+void remote_event(int type, int kind, long *fields, int nfields, const char *text, size_t text_len)
+{
+    char rec[64 + PATH_MAX + ICY_META_SIZE];
+
+    remote_write(rec, remote_record(rec, sizeof(rec), type, kind, fields, nfields, text, text_len),
+                 type == 'F');
+}
+
+/* @P: 0 stopped, 1 paused, 2 playing again */
+void remote_state(int state)
+{
+    long f = state;
+
+    if (options.opt & MPG321_REMOTE_BINARY)
+        remote_event('P', 0, &f, 1, NULL, 0);
+    else
+        remote_printf(0, "@P %d\n", state);
+
+    remote_flush();
+}
+
+/* @B: 1 when play waits on a stream's buffer to fill, 0 when it goes on */
+void remote_buffering(int buffering)
+{
+    long f = buffering;
+
+    if (options.opt & MPG321_REMOTE_BINARY)
+        remote_event('B', 0, &f, 1, NULL, 0);
+    else
+        remote_printf(0, "@B %d\n", buffering);
+
+    remote_flush();
+}
+
+/* @I: what's playing, by its kind */
+void remote_info(int kind, char *text)
+{
+    static char const *prefix[] = { "", "ID3:", "ICY-META: ", "RTP: " };
+
+    if (options.opt & MPG321_REMOTE_BINARY)
+        remote_event('I', kind, NULL, 0, text, strlen(text));
+    else
+        remote_printf(0, "@I %s%s\n", prefix[kind], text);
+
+    remote_flush();
+}
+
+/* @I ID3: the title, artist, album, year, comment and genre, 30 characters
+   each, any of them NULL if the tag hasn't it. As a record, each is padded
+   with NULs; as a line, only those left out are padded, with spaces, as
+   ever. */
+void remote_tag(char **names)
+{
+    char text[6 * 30 + 1];
+    int i, len;
+
+    if (options.opt & MPG321_REMOTE_BINARY)
+    {
+        memset(text, 0, sizeof(text));
+
+        for (i = 0; i < 6; i++)
+        {
+            if (names[i])
+                strncpy(text + i * 30, names[i], 30);
+        }
+
+        remote_event('I', REMOTE_INFO_ID3, NULL, 0, text, 6 * 30);
+        remote_flush();
+        return;
+    }
+
+    for (i = 0, len = 0; i < 6; i++)
+        len += sprintf(text + len, "%.30s", names[i] ? names[i] : "                              ");
+
+    remote_info(REMOTE_INFO_ID3, text);
+}
+
+/* @S: the stream, from its first frame. As a record the mode is libmad's
+   number for it, and there's no extension field, which repeats the mode
+   extension. */
+void remote_stream(struct mad_header const *header)
+{
+    long f[10];
+
+    f[0] = header->layer;
+    f[1] = header->samplerate;
+    f[2] = header->mode;
+    f[3] = header->mode_extension;
+    f[4] = (header->bitrate / 8 / 100) * mad_timer_count(header->duration, MAD_UNITS_CENTISECONDS);
+    f[5] = MAD_NCHANNELS(header);
+    f[6] = header->flags & MAD_FLAG_COPYRIGHT ? 1 : 0;
+    f[7] = header->flags & MAD_FLAG_PROTECTION ? 1 : 0;
+    f[8] = header->emphasis;
+    f[9] = header->bitrate / 1000;
+
+    if (options.opt & MPG321_REMOTE_BINARY)
+        remote_event('S', 0, f, 10, NULL, 0);
+    else
+        remote_printf(0, "@S 1.0 %ld %ld %s %ld %ld %ld %ld %ld %ld %ld %ld\n", f[0], f[1],
+                      modestringucase(header->mode), f[3], f[4], f[5], f[6], f[7], f[8], f[9], f[3]);
+
+    remote_flush();
+}
+
+/* @F: where play has got to, in frames and time. As a record, the times
+   are in hundredths of a second. */
+void remote_frame(long frame, long frames_left, mad_timer_t time, mad_timer_t time_left)
+{
+    long f[4];
+
+    f[0] = frame;
+    f[1] = frames_left;
+    f[2] = mad_timer_count(time, MAD_UNITS_CENTISECONDS);
+    f[3] = mad_timer_count(time_left, MAD_UNITS_CENTISECONDS);
+
+    if (options.opt & MPG321_REMOTE_BINARY)
+        remote_event('F', 0, f, 4, NULL, 0);
+    else
+        remote_printf(1, "@F %ld %ld %.2f %.2f\n", f[0], f[1], f[2] / 100.0, f[3] / 100.0);
+}
 
-    fd_set fd;
-    struct timeval tv = { 0, 0 };
-    FD_ZERO(&fd);
-    FD_SET(0,&fd);
+/* @E */
+static
+void remote_error(char *text)
+{
+    if (options.opt & MPG321_REMOTE_BINARY)
+        remote_event('E', 0, NULL, 0, text, strlen(text));
+    else
+        remote_printf(0, "@E %s\n", text);
+
+    remote_flush();
+}
+
+/* Starts reading commands */
+void remote_start(void)
+{
+    void * (*run)(void *) = remote_reader;
+    long version = 1;
+    sigset_t all, old;
+    int e;
+
+    if (options.opt & MPG321_REMOTE_BINARY)
+        hello_len = remote_record(hello, sizeof(hello), 'R', 0, &version, 1, NULL, 0);
+    else
+        hello_len = sprintf(hello, "@R MPG123\n");
+
+    if (options.remote_socket)
+    {
+        if ((listen_fd = unix_listen(options.remote_socket)) == -1 || pipe(wake) == -1)
+            exit(1);
 
-    alreadyread = strlen (remote_input_buf);
+        fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+        fcntl(wake[0], F_SETFL, fcntl(wake[0], F_GETFL) | O_NONBLOCK);
+        fcntl(wake[1], F_SETFL, fcntl(wake[1], F_GETFL) | O_NONBLOCK);
 
-    if (select (1, &fd, NULL, NULL, &tv))
+        run = remote_serve;
+    }
+
+    /* signals are for the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    e = pthread_create(&reader, NULL, run, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (e != 0)
     {
-      if (!(numread = read(0, remote_input_buf + alreadyread, (sizeof(input)-1)-alreadyread)) > 0)
-      {
-        numread = 0;
-        /* fprintf(stderr, "remote_parse_input() called with no input queued!");
+        errno = e;
+        perror("pthread_create");
         exit(1);
-        This never happens.. (read blocks) */
-      }
-    } else {
-      numread = 0;
     }
 
-    remote_input_buf[numread+alreadyread] = '\0';
-    
-    if ((arg = strchr(remote_input_buf, '\n')))
+    remote_write(hello, hello_len, 0);
+    remote_flush();
+}
+
+/* Sends what's been written since the last, all at once */
+void remote_flush(void)
+{
+    int wake_now = 0;
+
+    if (listen_fd == -1)
+    {
+        fflush(stdout);
+        return;
+    }
+
+    pthread_mutex_lock(&clients_lock);
+
+    if (nclients && !woken)
+        woken = wake_now = 1;
+
+    pthread_mutex_unlock(&clients_lock);
+
+    if (wake_now)
+        write(wake[1], "", 1);
+}
+
+/* Stops serving --socket clients, sending them what's left if it can */
+void remote_close(void)
+{
+    if (listen_fd == -1)
+    {
+        fflush(stdout);
+        return;
+    }
+
+    pthread_mutex_lock(&clients_lock);
+    quitting = 1;
+    pthread_mutex_unlock(&clients_lock);
+
+    write(wake[1], "", 1);
+    pthread_join(reader, NULL);
+
+    close(listen_fd);
+    close(wake[0]);
+    close(wake[1]);
+    unlink(options.remote_socket);
+    listen_fd = -1;
+}
+
+/* Takes the next whole line from the ring into line, as much of it as
+   fits; returns 0 if there isn't one */
+static
+int remote_line(char *line, size_t size)
+{
+    size_t len = 0;
+    char c;
+
+    pthread_mutex_lock(&ring_lock);
+
+    if (!lines_waiting)
     {
-        *(arg) = '\0';
+        pthread_mutex_unlock(&ring_lock);
+        return 0;
     }
 
-    linelen = strlen (remote_input_buf);
+    while (ring_len)
+    {
+        c = ring[ring_head];
+        ring_head = (ring_head + 1) % REMOTE_RING;
+        ring_len--;
+
+        if (c == '\n')
+            break;
+
+        if (len < size - 1)
+            line[len++] = c;
+    }
+
+    line[len] = '\0';
+    __atomic_sub_fetch(&lines_waiting, 1, __ATOMIC_RELEASE);
+
+    pthread_cond_broadcast(&ring_changed);
+    pthread_mutex_unlock(&ring_lock);
 
-    strcpy (input, remote_input_buf);
-    /* input[linelen] = '\0'; */
-    strcpy (new_remote_input_buf, remote_input_buf + linelen + 1);
-    /* don't copy the \0... */
-    strcpy (remote_input_buf, new_remote_input_buf);
+    return 1;
+}
+
+static
+enum mad_flow remote_parse_input(buffer *buf, playlist *pl)
+{
+    char input[PATH_MAX + 5]; /* for filename as well as input and space */
+    char *arg;
+
+    if (!remote_line(input, sizeof(input)))
+        return 0;
 
     trim_whitespace(input); /* Trims on left and right side only */
 
@@ -110,7 +742,10 @@ enum mad_flow remote_parse_input(buffer *buf, playlist *pl)
         {
             /* this works because if there's no argument, input is just
               'l' or 'load' */
-            printf("@E Missing argument to '%s'\n",input);
+            char error[PATH_MAX + 32];
+
+            snprintf(error, sizeof(error), "Missing argument to '%s'", input);
+            remote_error(error);
             return 0;
         }
     }
@@ -157,7 +792,7 @@ enum mad_flow remote_parse_input(buffer *buf, playlist *pl)
             clear_remote_file(pl);
             current_frame = 0;
             pause_play(NULL, NULL); /* reset pause data */
-            printf("@P 0\n");
+            remote_state(0);
         }
         
         goto stop;
@@ -195,38 +830,29 @@ stop:
     return MAD_FLOW_STOP;    
 }
 
+/* Waits for a command, and acts on it. If there'll be no more, that's
+   taken as a quit. */
 void remote_get_input_wait(buffer *buf)
 {
-    fd_set fd;
-    FD_ZERO(&fd);
-    FD_SET(0,&fd);
-    
-    if (!strlen (remote_input_buf))
-    {
-      select(1, &fd, NULL, NULL, NULL);
-    }
+    remote_flush();
+
+    pthread_mutex_lock(&ring_lock);
+
+    while (!lines_waiting && !input_ended)
+        pthread_cond_wait(&ring_changed, &ring_lock);
+
+    if (!lines_waiting)
+        quit_now = 1;
+
+    pthread_mutex_unlock(&ring_lock);
 
     remote_parse_input(buf, buf->pl);
 }
 
 enum mad_flow remote_get_input_nowait(buffer *buf)
 {
-    fd_set fd;
-    struct timeval tv = { 0, 0 };
-    FD_ZERO(&fd);
-    FD_SET(0,&fd);
-
-    if (!strlen (remote_input_buf))
-    {
-        if (select(1, &fd, NULL, NULL, &tv))
-            return remote_parse_input(buf, buf->pl);
+    if (!__atomic_load_n(&lines_waiting, __ATOMIC_ACQUIRE))
+        return 0;
 
-        else
-            return 0;
-    } 
-     
-    else 
-    {
-        return remote_parse_input(buf, buf->pl);
-    }
+    return remote_parse_input(buf, buf->pl);
 }
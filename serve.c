@@ -0,0 +1,644 @@
+/*
+    mpg321 - a fully free clone of mpg123.
+    serve.c: Copyright (C) 2001, 2002 Joe Drew
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#define _LARGEFILE_SOURCE 1
+
+#include "mpg321.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_SENDFILE_H)
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#define USE_SERVER 1
+#endif
+
+/* The HTTP server, --serve. What's played is kept as it's played, as MP3
+   frames and as the PCM that went to the audio device, in two rings in
+   files: memfds, where the kernel has them. Each listener has a place in
+   one of them, and is sent what's after it with sendfile(), straight from
+   the file, so the audio is copied once however many are listening. An
+   epoll loop in a thread of its own looks after the sockets; the decoder
+   only writes to the rings, and so listeners keep in step with what's
+   being played, and with its pacing. */
+
+#ifdef USE_SERVER
+
+enum
+{
+    SERVE_MP3,
+    SERVE_WAV,
+    SERVE_KINDS
+};
+
+/* What's been played, of one kind */
+struct serve_ring
+{
+    /* the file, SERVE_RING bytes long, written round and round */
+    int fd;
+
+    /* how much has been written in all, and where the last frame (or
+       sample) started, for a listener to start from */
+    off_t head;
+    off_t mark;
+};
+
+struct listener
+{
+    int fd;
+
+    /* SERVE_MP3 or SERVE_WAV, or -1 till the request has come in */
+    int kind;
+
+    char request[512];
+    size_t request_len;
+
+    /* response headers, and the WAV header, to go before the audio */
+    char header[256];
+    size_t header_len, header_pos;
+
+    /* where in the ring the next byte to send is */
+    off_t pos;
+
+    /* the WAV format it was told */
+    int format;
+
+    /* waiting for the socket to take more */
+    int waiting;
+};
+
+struct server
+{
+    int listen_fd;
+    int epoll_fd;
+
+    /* written to when there's something new in the rings */
+    int wake[2];
+    int woken;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int quit;
+
+    struct serve_ring ring[SERVE_KINDS];
+
+    /* the PCM in the WAV ring, and how many times that's changed */
+    int rate;
+    int channels;
+    int format;
+
+    struct listener *listeners[SERVE_MAX_LISTENERS];
+};
+
+/* A file to keep a ring in */
+static
+int ring_file(void)
+{
+    char name[] = "/tmp/mpg321-XXXXXX";
+    int fd = -1;
+
+#ifdef __NR_memfd_create
+    fd = syscall(__NR_memfd_create, "mpg321-serve", 0);
+#endif
+
+    if (fd == -1)
+    {
+        if ((fd = mkstemp(name)) == -1)
+            return -1;
+
+        unlink(name);
+    }
+
+    if (ftruncate(fd, SERVE_RING) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Add len bytes to a ring, as one frame (or run of samples). Lock must not
+   be held; only the decoder writes. */
+static
+void ring_add(struct server *s, int kind, unsigned char const *data, size_t len)
+{
+    struct serve_ring *r = &s->ring[kind];
+    off_t at = r->head % SERVE_RING;
+    size_t n = (len > SERVE_RING - at) ? SERVE_RING - at : len;
+    char c = 0;
+
+    if (pwrite(r->fd, data, n, at) != (ssize_t)n
+        || (n < len && pwrite(r->fd, data + n, len - n, 0) != (ssize_t)(len - n)))
+        return;
+
+    pthread_mutex_lock(&s->lock);
+
+    r->mark = r->head;
+    r->head += len;
+
+    if (!s->woken)
+    {
+        s->woken = 1;
+        write(s->wake[1], &c, 1);
+    }
+
+    pthread_mutex_unlock(&s->lock);
+}
+
+static
+void listener_close(struct server *s, int i)
+{
+    close(s->listeners[i]->fd);
+    free(s->listeners[i]);
+    s->listeners[i] = NULL;
+}
+
+/* The response to the request: the MP3 frames at / or /stream.mp3, the PCM
+   as a WAV file of no particular length at /stream.wav, and nothing else.
+   Lock must be held. Returns -1 to hang up. */
+static
+int listener_respond(struct server *s, struct listener *l)
+{
+    char path[256];
+    unsigned char *w;
+    int bytes;
+
+    if (sscanf(l->request, "GET %255s", path) != 1)
+        return -1;
+
+    if (strcmp(path, "/") == 0 || strcmp(path, "/stream.mp3") == 0)
+    {
+        l->kind = SERVE_MP3;
+        l->header_len = snprintf(l->header, sizeof(l->header),
+                                 "HTTP/1.0 200 OK\r\nContent-Type: audio/mpeg\r\n"
+                                 "Cache-Control: no-cache\r\nConnection: close\r\n\r\n");
+    }
+
+    else if (strcmp(path, "/stream.wav") == 0)
+    {
+        /* nothing's been played yet to say what the format is */
+        if (!s->rate)
+            return 0;
+
+        l->kind = SERVE_WAV;
+        l->format = s->format;
+        l->header_len = snprintf(l->header, sizeof(l->header),
+                                 "HTTP/1.0 200 OK\r\nContent-Type: audio/wav\r\n"
+                                 "Cache-Control: no-cache\r\nConnection: close\r\n\r\n");
+
+        /* RIFF header, with the lengths as long as they'll go */
+        w = (unsigned char *)l->header + l->header_len;
+        bytes = s->rate * s->channels * 2;
+        memcpy(w, "RIFF\377\377\377\377WAVEfmt \020\0\0\0\001\0", 22);
+        w[22] = s->channels;
+        w[23] = 0;
+        w[24] = s->rate & 0xff;
+        w[25] = (s->rate >> 8) & 0xff;
+        w[26] = (s->rate >> 16) & 0xff;
+        w[27] = 0;
+        w[28] = bytes & 0xff;
+        w[29] = (bytes >> 8) & 0xff;
+        w[30] = (bytes >> 16) & 0xff;
+        w[31] = 0;
+        w[32] = s->channels * 2;
+        w[33] = 0;
+        memcpy(w + 34, "\020\0data\377\377\377\377", 10);
+        l->header_len += 44;
+    }
+
+    else
+    {
+        l->header_len = snprintf(l->header, sizeof(l->header),
+                                 "HTTP/1.0 404 Not Found\r\nConnection: close\r\n\r\n");
+        send(l->fd, l->header, l->header_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        return -1;
+    }
+
+    l->pos = s->ring[l->kind].mark;
+
+    return 0;
+}
+
+/* Read what's come in from a listener: the request, or anything after it,
+   which is ignored. Returns -1 to hang up. */
+static
+int listener_read(struct server *s, struct listener *l)
+{
+    char buf[512];
+    ssize_t n;
+
+    if (l->kind != -1 || l->request_len == sizeof(l->request) - 1)
+    {
+        n = recv(l->fd, buf, sizeof(buf), MSG_DONTWAIT);
+        return (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) ? -1 : 0;
+    }
+
+    n = recv(l->fd, l->request + l->request_len, sizeof(l->request) - 1 - l->request_len, MSG_DONTWAIT);
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR))
+        return -1;
+
+    if (n > 0)
+    {
+        l->request_len += n;
+        l->request[l->request_len] = 0;
+    }
+
+    return 0;
+}
+
+/* Send a listener as much as it will take. Returns -1 to hang up. */
+static
+int listener_send(struct server *s, struct listener *l)
+{
+    struct serve_ring *r;
+    struct epoll_event ev;
+    off_t head, mark, at;
+    ssize_t n;
+    size_t len;
+    int channels;
+    int waiting = 0;
+
+    pthread_mutex_lock(&s->lock);
+
+    if (l->kind == -1 && (strstr(l->request, "\r\n\r\n") || strstr(l->request, "\n\n"))
+        && listener_respond(s, l) == -1)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+
+    if (l->kind == -1)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return 0;
+    }
+
+    /* the PCM has changed format since its header: it'll have to ask
+       again */
+    if (l->kind == SERVE_WAV && l->format != s->format)
+    {
+        pthread_mutex_unlock(&s->lock);
+        return -1;
+    }
+
+    r = &s->ring[l->kind];
+    head = r->head;
+    mark = r->mark;
+    channels = s->channels;
+
+    pthread_mutex_unlock(&s->lock);
+
+    /* too slow to keep up: skip to what's just been played, before the
+       ring comes round to what it's sending. Samples are skipped whole,
+       in case one has been half sent; an MP3 decoder finds the next frame
+       for itself. */
+    if (head - l->pos > SERVE_RING / 2)
+    {
+        if (l->kind == SERVE_WAV)
+            l->pos += (mark - l->pos) - (mark - l->pos) % (channels * 2);
+        else
+            l->pos = mark;
+    }
+
+    while (l->header_pos < l->header_len)
+    {
+        n = send(l->fd, l->header + l->header_pos, l->header_len - l->header_pos,
+                 MSG_NOSIGNAL | MSG_DONTWAIT);
+
+        if (n < 0 && errno == EAGAIN)
+        {
+            waiting = 1;
+            break;
+        }
+
+        if (n < 0 && errno != EINTR)
+            return -1;
+
+        if (n > 0)
+            l->header_pos += n;
+    }
+
+    while (!waiting && l->pos < head)
+    {
+        at = l->pos % SERVE_RING;
+        len = (head - l->pos > SERVE_RING - at) ? SERVE_RING - at : head - l->pos;
+
+        if ((n = sendfile(l->fd, r->fd, &at, len)) < 0)
+        {
+            if (errno == EAGAIN)
+                waiting = 1;
+            else if (errno != EINTR)
+                return -1;
+            continue;
+        }
+
+        l->pos += n;
+    }
+
+    /* wait for the socket to have room only while there's something to
+       send it */
+    if (waiting != l->waiting)
+    {
+        ev.events = EPOLLIN | (waiting ? EPOLLOUT : 0);
+        ev.data.ptr = l;
+        epoll_ctl(s->epoll_fd, EPOLL_CTL_MOD, l->fd, &ev);
+        l->waiting = waiting;
+    }
+
+    return 0;
+}
+
+static
+void listener_accept(struct server *s)
+{
+    struct listener *l;
+    struct epoll_event ev;
+    int fd, i;
+
+    while ((fd = accept(s->listen_fd, NULL, NULL)) >= 0)
+    {
+        for (i = 0; i < SERVE_MAX_LISTENERS && s->listeners[i]; i++)
+            ;
+
+        if (i == SERVE_MAX_LISTENERS || !(l = calloc(1, sizeof(struct listener))))
+        {
+            close(fd);
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        l->fd = fd;
+        l->kind = -1;
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = l;
+
+        if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+        {
+            close(fd);
+            free(l);
+            continue;
+        }
+
+        s->listeners[i] = l;
+    }
+}
+
+static
+void * serve_loop(void *arg)
+{
+    struct server *s = arg;
+    struct epoll_event events[SERVE_MAX_LISTENERS + 2];
+    struct listener *l;
+    char buf[64];
+    int n, i, j;
+
+    while (!s->quit)
+    {
+        if ((n = epoll_wait(s->epoll_fd, events, SERVE_MAX_LISTENERS + 2, -1)) < 0)
+            continue;
+
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &s->listen_fd)
+                listener_accept(s);
+
+            /* something new to send: to everyone who isn't still busy
+               with the last lot */
+            else if (events[i].data.ptr == &s->wake)
+            {
+                pthread_mutex_lock(&s->lock);
+                while (read(s->wake[0], buf, sizeof(buf)) > 0)
+                    ;
+                s->woken = 0;
+                pthread_mutex_unlock(&s->lock);
+
+                for (j = 0; j < SERVE_MAX_LISTENERS; j++)
+                {
+                    if ((l = s->listeners[j]) && !l->waiting && listener_send(s, l) == -1)
+                        listener_close(s, j);
+                }
+            }
+
+            else
+            {
+                l = events[i].data.ptr;
+
+                for (j = 0; j < SERVE_MAX_LISTENERS && s->listeners[j] != l; j++)
+                    ;
+
+                /* hung up on already, this time round */
+                if (j == SERVE_MAX_LISTENERS)
+                    continue;
+
+                if (((events[i].events & (EPOLLERR | EPOLLHUP))
+                     || ((events[i].events & EPOLLIN) && listener_read(s, l) == -1))
+                    || listener_send(s, l) == -1)
+                    listener_close(s, j);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* Serve what's played over HTTP on [host:]port arg */
+struct server * serve_open(char *arg)
+{
+    struct server *s;
+    struct epoll_event ev;
+    sigset_t all, old;
+    int i, e;
+
+    if (!(s = calloc(1, sizeof(struct server))))
+        return NULL;
+
+    s->listen_fd = s->epoll_fd = s->wake[0] = s->wake[1] = -1;
+    for (i = 0; i < SERVE_KINDS; i++)
+        s->ring[i].fd = -1;
+
+    pthread_mutex_init(&s->lock, NULL);
+
+    if ((s->listen_fd = tcp_listen(arg)) == -1)
+        goto fail;
+
+    for (i = 0; i < SERVE_KINDS; i++)
+    {
+        if ((s->ring[i].fd = ring_file()) == -1)
+            goto fail;
+    }
+
+    if (pipe(s->wake) == -1 || (s->epoll_fd = epoll_create(SERVE_MAX_LISTENERS + 2)) == -1)
+        goto fail;
+
+    fcntl(s->listen_fd, F_SETFL, fcntl(s->listen_fd, F_GETFL) | O_NONBLOCK);
+    fcntl(s->wake[0], F_SETFL, fcntl(s->wake[0], F_GETFL) | O_NONBLOCK);
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = &s->listen_fd;
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->listen_fd, &ev) == -1)
+        goto fail;
+
+    ev.data.ptr = &s->wake;
+    if (epoll_ctl(s->epoll_fd, EPOLL_CTL_ADD, s->wake[0], &ev) == -1)
+        goto fail;
+
+    /* a listener hanging up part way through a sendfile() */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* signals are for the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    e = pthread_create(&s->thread, NULL, serve_loop, s);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if ((errno = e) != 0)
+        goto fail;
+
+    return s;
+
+fail:
+    perror("serve_open");
+
+    if (s->listen_fd != -1)
+        close(s->listen_fd);
+    if (s->epoll_fd != -1)
+        close(s->epoll_fd);
+    if (s->wake[0] != -1)
+    {
+        close(s->wake[0]);
+        close(s->wake[1]);
+    }
+    for (i = 0; i < SERVE_KINDS; i++)
+    {
+        if (s->ring[i].fd != -1)
+            close(s->ring[i].fd);
+    }
+
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+
+    return NULL;
+}
+
+/* A frame of MP3 that's being played */
+void serve_frame(struct server *s, unsigned char const *frame, size_t len)
+{
+    ring_add(s, SERVE_MP3, frame, len);
+}
+
+/* len bytes of 16-bit PCM, in the machine's byte order, that's being
+   played */
+void serve_pcm(struct server *s, unsigned char const *pcm, size_t len, int rate, int channels)
+{
+#ifdef WORDS_BIGENDIAN
+    unsigned char swapped[1152 * 4];
+    size_t i;
+#endif
+
+    if (rate != s->rate || channels != s->channels)
+    {
+        pthread_mutex_lock(&s->lock);
+        s->rate = rate;
+        s->channels = channels;
+        s->format++;
+        pthread_mutex_unlock(&s->lock);
+    }
+
+#ifdef WORDS_BIGENDIAN
+    /* WAV is little-endian */
+    if (len > sizeof(swapped))
+        len = sizeof(swapped);
+
+    for (i = 0; i + 1 < len; i += 2)
+    {
+        swapped[i] = pcm[i + 1];
+        swapped[i + 1] = pcm[i];
+    }
+
+    pcm = swapped;
+#endif
+
+    ring_add(s, SERVE_WAV, pcm, len);
+}
+
+void serve_close(struct server *s)
+{
+    char c = 0;
+    int i;
+
+    s->quit = 1;
+    write(s->wake[1], &c, 1);
+    pthread_join(s->thread, NULL);
+
+    for (i = 0; i < SERVE_MAX_LISTENERS; i++)
+    {
+        if (s->listeners[i])
+            listener_close(s, i);
+    }
+
+    close(s->listen_fd);
+    close(s->epoll_fd);
+    close(s->wake[0]);
+    close(s->wake[1]);
+
+    for (i = 0; i < SERVE_KINDS; i++)
+        close(s->ring[i].fd);
+
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+#else /* USE_SERVER */
+
+struct server * serve_open(char *arg)
+{
+    fprintf(stderr, "--serve isn't supported on this system\n");
+    return NULL;
+}
+
+void serve_frame(struct server *s, unsigned char const *frame, size_t len)
+{
+}
+
+void serve_pcm(struct server *s, unsigned char const *pcm, size_t len, int rate, int channels)
+{
+}
+
+void serve_close(struct server *s)
+{
+}
+
+#endif /* USE_SERVER */
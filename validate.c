@@ -0,0 +1,396 @@
+/*
+    mpg321 - a fully free clone of mpg123.
+    validate.c: Copyright (C) 2001, 2002 Joe Drew
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#define _LARGEFILE_SOURCE 1
+
+#include "mpg321.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* --validate: the playlist entries coming up are checked by a few threads
+   while earlier ones play, so that a file that's missing, isn't a file,
+   or has no MPEG audio at the start can be passed over at once, instead
+   of stopping play or costing an open() and fstat() between files. What
+   was passed over is told all together at the end. */
+
+enum
+{
+    VALIDATE_EMPTY,
+    VALIDATE_WAITING,
+    VALIDATE_CHECKING,
+    VALIDATE_DONE
+};
+
+/* An entry being checked */
+struct check
+{
+    int state;
+    int index;
+    char *path;
+
+    /* why it won't play, or "" if it will */
+    char reason[128];
+};
+
+struct validator
+{
+    pthread_t threads[VALIDATE_THREADS];
+    int nthreads;
+
+    pthread_mutex_t lock;
+
+    /* signalled when there's an entry to check, and when one's been
+       checked */
+    pthread_cond_t work;
+    pthread_cond_t done;
+
+    /* entry n is in checks[n % VALIDATE_AHEAD]; the next to be taken to
+       check, and the next to be added */
+    struct check checks[VALIDATE_AHEAD];
+    int taken, added;
+
+    /* "path: reason" for each entry passed over */
+    char *report;
+    size_t report_len, report_size;
+    int dropped;
+
+    int quit;
+};
+
+/* Kilobits per second, by MPEG-1 or not, layer, and bitrate index */
+static const int bitrates[2][3][15] =
+{
+    {
+        { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+        { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+        { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 }
+    },
+    {
+        { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+        { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 }
+    }
+};
+
+static const int samplerates[3] = { 44100, 48000, 32000 };
+
+/* The length of the frame whose header is at p, 0 if it's free format,
+   or -1 if there isn't one there */
+static
+long frame_length(unsigned char const *p)
+{
+    int version, layer, bitrate, samplerate, padding;
+
+    if (p[0] != 0xff || (p[1] & 0xe0) != 0xe0)
+        return -1;
+
+    /* 3 is MPEG-1, 2 MPEG-2, 0 MPEG-2.5 */
+    version = (p[1] >> 3) & 3;
+    layer = 4 - ((p[1] >> 1) & 3);
+    bitrate = (p[2] >> 4) & 15;
+    samplerate = (p[2] >> 2) & 3;
+    padding = (p[2] >> 1) & 1;
+
+    if (version == 1 || layer == 4 || bitrate == 15 || samplerate == 3)
+        return -1;
+
+    if (bitrate == 0)
+        return 0;
+
+    bitrate = bitrates[version != 3][layer - 1][bitrate] * 1000;
+    samplerate = samplerates[samplerate] >> (version == 3 ? 0 : (version == 2 ? 1 : 2));
+
+    if (layer == 1)
+        return (12L * bitrate / samplerate + padding) * 4;
+
+    if (layer == 3 && version != 3)
+        return 72L * bitrate / samplerate + padding;
+
+    return 144L * bitrate / samplerate + padding;
+}
+
+/* Whether there's MPEG audio in the len bytes at p: a frame header, with
+   another like it where it says the next frame starts, unless p is the
+   whole of the file and that's past its end. Free format frames don't say,
+   and aren't enough to go on. */
+static
+int sniff(unsigned char const *p, long len, int whole)
+{
+    long i, n;
+
+    for (i = 0; i + 4 <= len; i++)
+    {
+        if ((n = frame_length(p + i)) <= 0)
+            continue;
+
+        if (i + n + 4 > len)
+        {
+            if (whole)
+                return 1;
+
+            continue;
+        }
+
+        /* the same version, layer and sample rate */
+        if (frame_length(p + i + n) >= 0 && (p[i + n + 1] & 0xfe) == (p[i + 1] & 0xfe)
+            && (p[i + n + 2] & 0x0c) == (p[i + 2] & 0x0c))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Checks a file; sets reason if it won't play */
+static
+void check(struct check *c)
+{
+    unsigned char *buf;
+    unsigned long datalen;
+    unsigned long skip;
+    struct stat st;
+    ssize_t got;
+    int fd;
+
+    /* streams and directories are left to be found out when played */
+    if (!c->path || strstr(c->path, "://") || strcmp(c->path, "-") == 0)
+        return;
+
+    if (stat(c->path, &st) == -1)
+    {
+        snprintf(c->reason, sizeof(c->reason), "%s", strerror(errno));
+        return;
+    }
+
+    if (S_ISDIR(st.st_mode))
+        return;
+
+    if (!S_ISREG(st.st_mode))
+    {
+        snprintf(c->reason, sizeof(c->reason), "Not a regular file");
+        return;
+    }
+
+    if (st.st_size == 0)
+    {
+        snprintf(c->reason, sizeof(c->reason), "Empty file");
+        return;
+    }
+
+    if ((fd = open(c->path, O_RDONLY)) == -1)
+    {
+        snprintf(c->reason, sizeof(c->reason), "%s", strerror(errno));
+        return;
+    }
+
+    if (!(buf = malloc(VALIDATE_SNIFF)))
+    {
+        close(fd);
+        return;
+    }
+
+    /* past any tags at the start */
+    if ((got = pread(fd, buf, VALIDATE_SNIFF, 0)) > 0
+        && (skip = leading_tag_size(buf, got, &datalen)) > 0)
+    {
+        got = (skip < (unsigned long)st.st_size) ? pread(fd, buf, VALIDATE_SNIFF, skip) : 0;
+    }
+
+    if (got < 0)
+        snprintf(c->reason, sizeof(c->reason), "%s", strerror(errno));
+
+    else if (!sniff(buf, got, got < VALIDATE_SNIFF))
+        snprintf(c->reason, sizeof(c->reason), "No MPEG audio found");
+
+    free(buf);
+    close(fd);
+}
+
+static
+void * validate_thread(void *arg)
+{
+    struct validator *v = arg;
+    struct check *c;
+
+    pthread_mutex_lock(&v->lock);
+
+    while (!v->quit)
+    {
+        if (v->taken == v->added)
+        {
+            pthread_cond_wait(&v->work, &v->lock);
+            continue;
+        }
+
+        c = &v->checks[v->taken++ % VALIDATE_AHEAD];
+        c->state = VALIDATE_CHECKING;
+
+        pthread_mutex_unlock(&v->lock);
+
+        check(c);
+
+        pthread_mutex_lock(&v->lock);
+
+        c->state = VALIDATE_DONE;
+        pthread_cond_broadcast(&v->done);
+    }
+
+    pthread_mutex_unlock(&v->lock);
+
+    return NULL;
+}
+
+struct validator * validate_open(void)
+{
+    struct validator *v;
+    sigset_t all, old;
+
+    if (!(v = calloc(1, sizeof(struct validator))))
+        return NULL;
+
+    pthread_mutex_init(&v->lock, NULL);
+    pthread_cond_init(&v->work, NULL);
+    pthread_cond_init(&v->done, NULL);
+
+    /* signals are for the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (v->nthreads = 0; v->nthreads < VALIDATE_THREADS; v->nthreads++)
+    {
+        if (pthread_create(&v->threads[v->nthreads], NULL, validate_thread, v) != 0)
+            break;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (!v->nthreads)
+    {
+        validate_close(v);
+        return NULL;
+    }
+
+    return v;
+}
+
+/* How many more entries can be added: no more than VALIDATE_AHEAD past
+   the one to be played next */
+int validate_room(struct validator *v, int next)
+{
+    return next + VALIDATE_AHEAD - v->added;
+}
+
+/* Entry index (the next after the last added) is to be checked */
+void validate_add(struct validator *v, int index, char *path)
+{
+    struct check *c = &v->checks[index % VALIDATE_AHEAD];
+
+    pthread_mutex_lock(&v->lock);
+
+    free(c->path);
+    c->path = strdup(path);
+    c->index = index;
+    c->reason[0] = '\0';
+    c->state = c->path ? VALIDATE_WAITING : VALIDATE_DONE;
+    v->added = index + 1;
+
+    pthread_cond_signal(&v->work);
+    pthread_mutex_unlock(&v->lock);
+}
+
+/* Whether entry index, once it's been checked, will play. If it won't,
+   it goes in the report. Entries not added are taken to. */
+int validate_result(struct validator *v, int index)
+{
+    struct check *c = &v->checks[index % VALIDATE_AHEAD];
+    size_t need;
+    char *grown;
+    int ok;
+
+    if (index >= v->added || c->index != index)
+        return 1;
+
+    pthread_mutex_lock(&v->lock);
+
+    while (c->state != VALIDATE_DONE)
+        pthread_cond_wait(&v->done, &v->lock);
+
+    pthread_mutex_unlock(&v->lock);
+
+    if ((ok = !c->reason[0]))
+        return 1;
+
+    need = v->report_len + strlen(c->path) + strlen(c->reason) + 6;
+
+    if (need > v->report_size && (grown = realloc(v->report, need * 2)))
+    {
+        v->report = grown;
+        v->report_size = need * 2;
+    }
+
+    if (need <= v->report_size)
+        v->report_len += sprintf(v->report + v->report_len, "  %s: %s\n", c->path, c->reason);
+
+    v->dropped++;
+
+    return 0;
+}
+
+/* Tells of everything passed over, all together */
+void validate_report(struct validator *v)
+{
+    if (!v->dropped)
+        return;
+
+    fprintf(stderr, "%d playlist entr%s passed over:\n%s", v->dropped,
+            v->dropped == 1 ? "y was" : "ies were", v->report ? v->report : "");
+
+    v->dropped = 0;
+    v->report_len = 0;
+}
+
+void validate_close(struct validator *v)
+{
+    int i;
+
+    pthread_mutex_lock(&v->lock);
+    v->quit = 1;
+    pthread_cond_broadcast(&v->work);
+    pthread_mutex_unlock(&v->lock);
+
+    for (i = 0; i < v->nthreads; i++)
+        pthread_join(v->threads[i], NULL);
+
+    for (i = 0; i < VALIDATE_AHEAD; i++)
+        free(v->checks[i].path);
+
+    pthread_mutex_destroy(&v->lock);
+    pthread_cond_destroy(&v->work);
+    pthread_cond_destroy(&v->done);
+
+    free(v->report);
+    free(v);
+}
@@ -0,0 +1,508 @@
+/*
+    mpg321 - a fully free clone of mpg123.
+    walk.c: Copyright (C) 2001, 2002 Joe Drew
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#define _LARGEFILE_SOURCE 1
+
+#include "mpg321.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* Finding the MPEG audio files under a directory given to play. A few
+   threads share out the directories between them, reading each in big
+   lumps with getdents64() where there is such a thing. Each directory's
+   files and subdirectories are sorted, and the files are handed out to
+   play in the order one thread reading them all would find them: a
+   directory's own, then each subdirectory's in turn. Play starts as soon
+   as the first directory has been read, while the rest are read ahead. */
+
+/* A directory found, and once it's been read, what's in it */
+struct walk_node
+{
+    char *path;
+    struct walk_node *parent;
+    int read;
+
+    /* files, and those given out so far */
+    char **files;
+    int nfiles, next_file;
+
+    /* subdirectories, and those gone into so far */
+    struct walk_node **subdirs;
+    int nsubdirs, next_subdir;
+};
+
+struct walk
+{
+    pthread_t threads[WALK_THREADS];
+    int nthreads;
+
+    pthread_mutex_t lock;
+
+    /* signalled when there are directories to read, and when one's been
+       read; and for both when it's all been done */
+    pthread_cond_t work;
+    pthread_cond_t found;
+
+    /* directories still to read, taken from the end, and how many are
+       being read */
+    struct walk_node **dirs;
+    int ndirs, dirs_size;
+    int busy;
+
+    /* where files are being given out from; NULL when that's all */
+    struct walk_node *at;
+
+    int quit;
+};
+
+/* What's been found in one directory */
+struct walk_list
+{
+    char **names;
+    int n, size;
+};
+
+static
+int walk_compare(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static
+int walk_add(struct walk_list *list, char *dir, char *name)
+{
+    char **names;
+    char *path;
+
+    if (list->n == list->size)
+    {
+        if (!(names = realloc(list->names, (list->size ? list->size * 2 : 64) * sizeof(char *))))
+            return -1;
+
+        list->names = names;
+        list->size = list->size ? list->size * 2 : 64;
+    }
+
+    if (!(path = malloc(strlen(dir) + strlen(name) + 2)))
+        return -1;
+
+    sprintf(path, "%s/%s", dir, name);
+    list->names[list->n++] = path;
+
+    return 0;
+}
+
+/* Whether name is one to play, by its extension */
+static
+int walk_playable(char *name)
+{
+    char *dot = strrchr(name, '.');
+
+    return dot && (strcasecmp(dot, ".mp3") == 0 || strcasecmp(dot, ".mp2") == 0
+                   || strcasecmp(dot, ".mp1") == 0);
+}
+
+/* An entry of directory dir (open as fd): type is its DT_ type, which may
+   have to be found out */
+static
+void walk_entry(int fd, char *dir, char *name, int type,
+                struct walk_list *subdirs, struct walk_list *files)
+{
+    struct stat st;
+
+    /* hidden, and . and .. */
+    if (name[0] == '.')
+        return;
+
+    if (type == DT_UNKNOWN)
+    {
+        if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            return;
+
+        if (S_ISDIR(st.st_mode))
+            type = DT_DIR;
+        else if (S_ISREG(st.st_mode))
+            type = DT_REG;
+        else if (S_ISLNK(st.st_mode))
+            type = DT_LNK;
+    }
+
+    /* symbolic links are followed to files, but not to directories, which
+       could go round in circles */
+    if (type == DT_LNK)
+    {
+        if (fstatat(fd, name, &st, 0) == -1 || !S_ISREG(st.st_mode))
+            return;
+
+        type = DT_REG;
+    }
+
+    if (type == DT_DIR)
+        walk_add(subdirs, dir, name);
+
+    else if (type == DT_REG && walk_playable(name))
+        walk_add(files, dir, name);
+}
+
+#ifdef SYS_getdents64
+
+struct walk_dirent
+{
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+
+static
+void walk_read(int fd, char *dir, struct walk_list *subdirs, struct walk_list *files)
+{
+    char *buf;
+    struct walk_dirent *d;
+    long got, pos;
+
+    if (!(buf = malloc(WALK_BUF_SIZE)))
+        return;
+
+    while ((got = syscall(SYS_getdents64, fd, buf, WALK_BUF_SIZE)) > 0)
+    {
+        for (pos = 0; pos < got; pos += d->d_reclen)
+        {
+            d = (struct walk_dirent *)(buf + pos);
+            walk_entry(fd, dir, d->d_name, d->d_type, subdirs, files);
+        }
+    }
+
+    free(buf);
+}
+
+#else /* SYS_getdents64 */
+
+static
+void walk_read(int fd, char *dir, struct walk_list *subdirs, struct walk_list *files)
+{
+    DIR *d;
+    struct dirent *e;
+
+    /* closedir() closes it */
+    if ((fd = dup(fd)) == -1 || !(d = fdopendir(fd)))
+        return;
+
+    while ((e = readdir(d)))
+        walk_entry(dirfd(d), dir, e->d_name, e->d_type, subdirs, files);
+
+    closedir(d);
+}
+
+#endif /* SYS_getdents64 */
+
+static
+struct walk_node * walk_node(char *path, struct walk_node *parent)
+{
+    struct walk_node *n;
+
+    if (!(n = calloc(1, sizeof(struct walk_node))))
+        return NULL;
+
+    n->path = path;
+    n->parent = parent;
+
+    return n;
+}
+
+/* Frees n and all under it that hasn't been freed as it was given out */
+static
+void walk_free(struct walk_node *n)
+{
+    int i;
+
+    for (i = n->next_file; i < n->nfiles; i++)
+        free(n->files[i]);
+
+    for (i = n->next_subdir; i < n->nsubdirs; i++)
+        walk_free(n->subdirs[i]);
+
+    free(n->files);
+    free(n->subdirs);
+    free(n->path);
+    free(n);
+}
+
+/* Reads directory n, and passes on what's in it */
+static
+void walk_dir(struct walk *w, struct walk_node *n)
+{
+    struct walk_list subdirs = { NULL, 0, 0 }, files = { NULL, 0, 0 };
+    struct walk_node **nodes = NULL;
+    struct walk_node **grown;
+    int fd, i, j, size;
+
+    if ((fd = openat(AT_FDCWD, n->path, O_RDONLY | O_DIRECTORY)) == -1)
+        mpg321_error(n->path);
+
+    else
+    {
+        walk_read(fd, n->path, &subdirs, &files);
+        close(fd);
+
+        qsort(subdirs.names, subdirs.n, sizeof(char *), walk_compare);
+        qsort(files.names, files.n, sizeof(char *), walk_compare);
+    }
+
+    /* a subdirectory there's no memory for is passed over */
+    if (subdirs.n && (nodes = malloc(subdirs.n * sizeof(struct walk_node *))))
+    {
+        for (i = j = 0; i < subdirs.n; i++)
+        {
+            if ((nodes[j] = walk_node(subdirs.names[i], n)))
+                j++;
+            else
+                free(subdirs.names[i]);
+        }
+
+        subdirs.n = j;
+    }
+
+    else
+    {
+        for (i = 0; i < subdirs.n; i++)
+            free(subdirs.names[i]);
+
+        subdirs.n = 0;
+    }
+
+    pthread_mutex_lock(&w->lock);
+
+    /* the directories in reverse, so that the first is read first */
+    if (w->ndirs + subdirs.n > w->dirs_size)
+    {
+        for (size = w->dirs_size; w->ndirs + subdirs.n > size; size *= 2)
+            ;
+
+        if ((grown = realloc(w->dirs, size * sizeof(struct walk_node *))))
+        {
+            w->dirs = grown;
+            w->dirs_size = size;
+        }
+    }
+
+    /* one that can't go on the stack is never read, but still has its
+       place, with nothing in it */
+    for (i = subdirs.n - 1; i >= 0; i--)
+    {
+        if (w->ndirs < w->dirs_size)
+            w->dirs[w->ndirs++] = nodes[i];
+        else
+            nodes[i]->read = 1;
+    }
+
+    n->files = files.names;
+    n->nfiles = files.n;
+    n->subdirs = nodes;
+    n->nsubdirs = subdirs.n;
+    n->read = 1;
+
+    if (subdirs.n)
+        pthread_cond_broadcast(&w->work);
+
+    pthread_cond_broadcast(&w->found);
+    pthread_mutex_unlock(&w->lock);
+
+    free(subdirs.names);
+}
+
+static
+void * walk_thread(void *arg)
+{
+    struct walk *w = arg;
+    struct walk_node *n;
+
+    pthread_mutex_lock(&w->lock);
+
+    while (!w->quit)
+    {
+        /* nothing to read now, but what others are reading may have more
+           in it */
+        while (!w->quit && !w->ndirs && w->busy)
+            pthread_cond_wait(&w->work, &w->lock);
+
+        if (w->quit || !w->ndirs)
+            break;
+
+        n = w->dirs[--w->ndirs];
+        w->busy++;
+
+        pthread_mutex_unlock(&w->lock);
+
+        walk_dir(w, n);
+
+        pthread_mutex_lock(&w->lock);
+
+        /* all done */
+        if (!--w->busy && !w->ndirs)
+            pthread_cond_broadcast(&w->work);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+/* Starts looking for files to play under directory dir */
+struct walk * walk_open(char *dir)
+{
+    struct walk *w;
+    char *path;
+    size_t len = strlen(dir);
+    sigset_t all, old;
+
+    if (!(w = calloc(1, sizeof(struct walk))))
+        return NULL;
+
+    w->dirs_size = 64;
+
+    if (!(w->dirs = malloc(w->dirs_size * sizeof(struct walk_node *)))
+        || !(path = strdup(dir)))
+    {
+        free(w->dirs);
+        free(w);
+        return NULL;
+    }
+
+    /* dir/ would give dir//file */
+    while (len > 1 && path[len - 1] == '/')
+        path[--len] = '\0';
+
+    if (!(w->at = walk_node(path, NULL)))
+    {
+        free(path);
+        free(w->dirs);
+        free(w);
+        return NULL;
+    }
+
+    w->dirs[0] = w->at;
+    w->ndirs = 1;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->found, NULL);
+
+    /* signals are for the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    for (w->nthreads = 0; w->nthreads < WALK_THREADS; w->nthreads++)
+    {
+        if (pthread_create(&w->threads[w->nthreads], NULL, walk_thread, w) != 0)
+            break;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    /* not even one: read it all now */
+    if (!w->nthreads)
+        walk_thread(w);
+
+    return w;
+}
+
+/* The next file, waiting for it to be found if need be, into path.
+   Returns 0 when there are no more. */
+int walk_next(struct walk *w, char *path, size_t size)
+{
+    struct walk_node *n;
+    int ret = 0;
+
+    pthread_mutex_lock(&w->lock);
+
+    while ((n = w->at))
+    {
+        while (!n->read)
+            pthread_cond_wait(&w->found, &w->lock);
+
+        if (n->next_file < n->nfiles)
+        {
+            strncpy(path, n->files[n->next_file], size);
+            path[size - 1] = '\0';
+            free(n->files[n->next_file++]);
+            ret = 1;
+            break;
+        }
+
+        if (n->next_subdir < n->nsubdirs)
+        {
+            w->at = n->subdirs[n->next_subdir++];
+            continue;
+        }
+
+        /* all of it's been given out */
+        w->at = n->parent;
+        walk_free(n);
+    }
+
+    pthread_mutex_unlock(&w->lock);
+
+    return ret;
+}
+
+/* Stops looking, if it hasn't finished */
+void walk_close(struct walk *w)
+{
+    struct walk_node *n, *parent;
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    w->quit = 1;
+    pthread_cond_broadcast(&w->work);
+    pthread_mutex_unlock(&w->lock);
+
+    for (i = 0; i < w->nthreads; i++)
+        pthread_join(w->threads[i], NULL);
+
+    /* up from where files were being given out, each directory with what
+       comes after in it; what came before has been freed */
+    for (n = w->at; n; n = parent)
+    {
+        parent = n->parent;
+        walk_free(n);
+    }
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->work);
+    pthread_cond_destroy(&w->found);
+
+    free(w->dirs);
+    free(w);
+}